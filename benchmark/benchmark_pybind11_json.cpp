@@ -0,0 +1,408 @@
+/***************************************************************************
+* Copyright (c) 2019, Martin Renou                                         *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "pybind11_json/pybind11_json.hpp"
+#include "pybind11_json/file.hpp"
+
+#include "pybind11/embed.h"
+
+namespace py = pybind11;
+namespace nl = nlohmann;
+
+namespace
+{
+    // Representative payloads, built once in Python
+    const char* corpus_source = R"(
+import array
+import math
+
+def deep(depth):
+    node = {"leaf": [1, 2.5, "x"]}
+    for i in range(depth):
+        node = {"level": i, "child": node}
+    return node
+
+corpora = {
+    "flat_records": [
+        {"id": i, "name": "user%d" % i, "email": "user%d@example.com" % i,
+         "active": i % 3 == 0, "score": i * 0.25, "tags": ["a", "b", "c"]}
+        for i in range(20000)
+    ],
+    "deep_nesting": [deep(200) for _ in range(50)],
+    "string_heavy": [
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit %d éè \"quoted\"" % i
+        for i in range(50000)
+    ],
+    "integer_heavy": [i * 2654435761 % (1 << 62) for i in range(200000)],
+    "big_floats": [i * 1.2345678901234567e200 for i in range(1, 200001)],
+    "bytes_blobs": [bytes(range(256)) * 64 for _ in range(200)],
+    "large_array": list(range(1000000)),
+    "float_buffer": array.array("d", (i * 0.001 for i in range(1000000))),
+    "metric_samples": [
+        {"time": 1700000000 + i * 0.015, "cpu": math.sin(i) * 50 + 50, "latency": math.exp(math.cos(i))}
+        for i in range(100000)
+    ],
+    "shared_subtrees": [
+        {"id": i, "config": config, "tags": tags}
+        for config in [{"setting%d" % k: {"enabled": k % 2 == 0, "values": list(range(10))} for k in range(20)}]
+        for tags in [("a", "b", "c")]
+        for i in range(20000)
+    ],
+}
+)";
+
+    const char* corpus_names[] = {
+        "flat_records", "deep_nesting", "string_heavy", "integer_heavy", "big_floats", "bytes_blobs", "large_array", "float_buffer", "metric_samples", "shared_subtrees"
+    };
+
+    struct corpus
+    {
+        std::string name;
+        py::object obj;
+        nl::json json;
+        std::shared_ptr<const nl::json> shared;
+        std::string text;
+        std::string lines;
+        std::string path;
+        std::vector<std::uint8_t> cbor;
+        std::int64_t nodes;
+    };
+
+    std::vector<corpus>& corpora()
+    {
+        static std::vector<corpus> instance;
+        return instance;
+    }
+
+    py::module& bindings()
+    {
+        static py::module instance;
+        return instance;
+    }
+
+    std::int64_t count_nodes(const nl::json& j)
+    {
+        std::int64_t count = 1;
+        if (j.is_structured())
+        {
+            for (const nl::json& child : j)
+            {
+                count += count_nodes(child);
+            }
+        }
+        return count;
+    }
+
+    const nl::json& identity(const nl::json& j)
+    {
+        return j;
+    }
+
+    void load_corpora()
+    {
+        py::exec(corpus_source);
+        py::object sources = py::module::import("__main__").attr("corpora");
+        for (const char* name : corpus_names)
+        {
+            corpus c;
+            c.name = name;
+            c.obj = sources[name];
+            c.json = pyjson::to_json(c.obj);
+            c.shared = std::make_shared<const nl::json>(c.json);
+            c.text = c.json.dump();
+            pyjson::dump_lines(c.obj, c.lines);
+            c.path = "pybind11_json_benchmark_" + c.name + ".json";
+            std::ofstream(c.path, std::ios::binary) << c.text;
+            c.cbor = nl::json::to_cbor(c.json);
+            c.nodes = count_nodes(c.json);
+            corpora().push_back(std::move(c));
+        }
+
+        bindings() = py::module_::create_extension_module("benchmark_bindings", nullptr, new py::module_::module_def);
+        bindings().def("identity", &identity);
+    }
+
+    // Throughput is reported against the size of the JSON text, so that
+    // MB/s are comparable between both directions.
+    void set_throughput(benchmark::State& state, const corpus& c)
+    {
+        state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(c.text.size()));
+        state.SetItemsProcessed(state.iterations() * c.nodes);
+    }
+
+    void register_benchmarks()
+    {
+        // Overload resolution trying an nl::json parameter with an object
+        // it cannot convert
+        benchmark::RegisterBenchmark("caster_mismatch", [](benchmark::State& state)
+        {
+            py::object obj = py::eval("object()");
+            for (auto _ : state)
+            {
+                py::detail::type_caster<nl::json> caster;
+                bool loaded = caster.load(obj, true);
+                benchmark::DoNotOptimize(loaded);
+            }
+        })->Unit(benchmark::kNanosecond);
+
+        for (const corpus& c : corpora())
+        {
+            const corpus* data = &c;
+
+            benchmark::RegisterBenchmark(("to_json/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    nl::json j = pyjson::to_json(data->obj);
+                    benchmark::DoNotOptimize(j);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("to_json_arena/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                pyjson::arena arena;
+                for (auto _ : state)
+                {
+                    {
+                        pyjson::arena_json j = pyjson::to_json(data->obj, arena);
+                        benchmark::DoNotOptimize(j);
+                    }
+                    arena.release();
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("to_json_memo/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                pyjson::options options;
+                options.memoize = pyjson::memo_policy::all;
+                for (auto _ : state)
+                {
+                    nl::json j = pyjson::to_json(data->obj, options);
+                    benchmark::DoNotOptimize(j);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("dump_memo/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                pyjson::dump_options options;
+                options.memoize = pyjson::memo_policy::all;
+                for (auto _ : state)
+                {
+                    std::string text = pyjson::dumps(data->obj, options);
+                    benchmark::DoNotOptimize(text);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("dump/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    std::string text = pyjson::dumps(data->obj);
+                    benchmark::DoNotOptimize(text);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("dump_precision/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                pyjson::dump_options options;
+                options.float_precision = 6;
+                for (auto _ : state)
+                {
+                    std::string text = pyjson::dumps(data->obj, options);
+                    benchmark::DoNotOptimize(text);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("to_json_dump/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    std::string text = pyjson::to_json(data->obj).dump();
+                    benchmark::DoNotOptimize(text);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("from_json/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object obj = pyjson::from_json(data->json);
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            // Only what is read gets converted: here the first item
+            benchmark::RegisterBenchmark(("view_first_item/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object view = pyjson::make_view(pyjson::json_view(data->shared));
+                    py::object item = view[py::int_(0)];
+                    benchmark::DoNotOptimize(item.ptr());
+                }
+            })->Unit(benchmark::kMicrosecond);
+
+            benchmark::RegisterBenchmark(("loads/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object obj = pyjson::loads(data->text);
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("load_file/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object obj = pyjson::load_file(data->path);
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            // Reading the file into a string, then parse and from_json
+            benchmark::RegisterBenchmark(("read_parse_from_json/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    std::ifstream file(data->path, std::ios::binary);
+                    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                    py::object obj = pyjson::from_json(nl::json::parse(text));
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("ndjson_reader/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    pyjson::ndjson_reader reader(data->lines.data(), data->lines.size());
+                    while (reader.next_batch().size() > 0)
+                    {
+                    }
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            // A binding called for each line: parse and from_json per line
+            benchmark::RegisterBenchmark(("parse_from_json_lines/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    std::size_t begin = 0;
+                    std::size_t end = 0;
+                    while ((end = data->lines.find('\n', begin)) != std::string::npos)
+                    {
+                        py::object obj = pyjson::from_json(nl::json::parse(data->lines.data() + begin, data->lines.data() + end));
+                        benchmark::DoNotOptimize(obj.ptr());
+                        begin = end + 1;
+                    }
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            // Selecting the last item: everything before it is skipped
+            benchmark::RegisterBenchmark(("loads_pointer/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                std::vector<std::string> pointers = {"/" + std::to_string(data->json.size() - 1)};
+                for (auto _ : state)
+                {
+                    py::dict selected = pyjson::loads(data->text, pointers);
+                    benchmark::DoNotOptimize(selected.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("parse_from_json/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object obj = pyjson::from_json(nl::json::parse(data->text));
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("to_cbor/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    std::vector<std::uint8_t> cbor = pyjson::to_cbor(data->obj);
+                    benchmark::DoNotOptimize(cbor);
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("from_cbor/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                for (auto _ : state)
+                {
+                    py::object obj = pyjson::from_cbor(data->cbor);
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+
+            benchmark::RegisterBenchmark(("caster_round_trip/" + c.name).c_str(), [data](benchmark::State& state)
+            {
+                py::object identity = bindings().attr("identity");
+                for (auto _ : state)
+                {
+                    py::object obj = identity(data->obj);
+                    benchmark::DoNotOptimize(obj.ptr());
+                }
+                set_throughput(state, *data);
+            })->Unit(benchmark::kMillisecond);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    py::scoped_interpreter guard;
+    load_corpora();
+    register_benchmarks();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+
+    for (const corpus& c : corpora())
+    {
+        std::remove(c.path.c_str());
+    }
+
+    // Python objects must be released before the interpreter
+    corpora().clear();
+    bindings() = py::module();
+    return 0;
+}
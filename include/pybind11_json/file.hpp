@@ -0,0 +1,169 @@
+/***************************************************************************
+* Copyright (c) 2019, Martin Renou                                         *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef PYBIND11_JSON_FILE_HPP
+#define PYBIND11_JSON_FILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "pybind11_json/pybind11_json.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace pyjson
+{
+    namespace detail
+    {
+        /*
+         * Read-only contents of a whole file: memory-mapped with a sequential
+         * access hint where available, so that pages are read in as the parser
+         * reaches them, or read into memory without the GIL otherwise.
+         */
+        class mapped_file
+        {
+        public:
+
+            explicit mapped_file(const std::string& path)
+            {
+#ifdef _WIN32
+                py::gil_scoped_release release;
+                int fd = ::_open(path.c_str(), _O_RDONLY | _O_BINARY);
+                if (fd < 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+                }
+                try
+                {
+                    struct _stat64 info;
+                    if (::_fstat64(fd, &info) != 0)
+                    {
+                        throw std::system_error(errno, std::generic_category(), "cannot stat " + path);
+                    }
+                    m_buffer.resize(static_cast<std::size_t>(info.st_size));
+                    std::size_t size = 0;
+                    while (size < m_buffer.size())
+                    {
+                        const unsigned int chunk = static_cast<unsigned int>((std::min)(m_buffer.size() - size, std::size_t(1) << 30));
+                        int count = ::_read(fd, m_buffer.data() + size, chunk);
+                        if (count < 0)
+                        {
+                            throw std::system_error(errno, std::generic_category(), "cannot read " + path);
+                        }
+                        if (count == 0)
+                        {
+                            break;
+                        }
+                        size += static_cast<std::size_t>(count);
+                    }
+                    m_data = m_buffer.data();
+                    m_size = size;
+                }
+                catch (...)
+                {
+                    ::_close(fd);
+                    throw;
+                }
+                ::_close(fd);
+#else
+                py::gil_scoped_release release;
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+                }
+                struct stat info;
+                if (::fstat(fd, &info) != 0)
+                {
+                    int error = errno;
+                    ::close(fd);
+                    throw std::system_error(error, std::generic_category(), "cannot stat " + path);
+                }
+                m_size = static_cast<std::size_t>(info.st_size);
+                if (m_size > 0)
+                {
+                    void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (data == MAP_FAILED)
+                    {
+                        int error = errno;
+                        ::close(fd);
+                        throw std::system_error(error, std::generic_category(), "cannot map " + path);
+                    }
+                    m_data = static_cast<const char*>(data);
+                    // The kernel reads ahead while the parser walks the mapping
+#ifdef MADV_SEQUENTIAL
+                    ::madvise(data, m_size, MADV_SEQUENTIAL);
+#endif
+                }
+                ::close(fd);
+#endif
+            }
+
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            ~mapped_file()
+            {
+#ifndef _WIN32
+                if (m_size > 0)
+                {
+                    ::munmap(const_cast<char*>(m_data), m_size);
+                }
+#endif
+            }
+
+            const char* data() const
+            {
+                return m_data;
+            }
+
+            std::size_t size() const
+            {
+                return m_size;
+            }
+
+        private:
+
+            std::vector<char> m_buffer;
+            const char* m_data = "";
+            std::size_t m_size = 0;
+        };
+    }
+
+    /*
+     * Parses a JSON file straight into Python objects, without copying its
+     * text: peak memory is about the size of the resulting objects. Parse
+     * errors throw nl::json::parse_error, I/O errors std::system_error.
+     */
+    inline py::object load_file(const std::string& path)
+    {
+        PYBIND11_JSON_STATS_SCOPE("load_file");
+        detail::mapped_file file(path);
+        return detail::loads(file.data(), file.size(), nullptr);
+    }
+
+    inline py::object load_file(const std::string& path, key_cache& keys)
+    {
+        PYBIND11_JSON_STATS_SCOPE("load_file");
+        detail::mapped_file file(path);
+        return detail::loads(file.data(), file.size(), &keys);
+    }
+}
+
+#endif
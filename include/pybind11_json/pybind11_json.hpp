@@ -9,158 +9,5348 @@
 #ifndef PYBIND11_JSON_HPP
 #define PYBIND11_JSON_HPP
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <set>
 #include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "nlohmann/json.hpp"
 
 #include "pybind11/pybind11.h"
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<charconv>) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#include <charconv>
+#endif
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Free-threaded CPython builds can convert large containers in parallel
+#if defined(Py_GIL_DISABLED) && !defined(PYBIND11_JSON_PARALLEL)
+#define PYBIND11_JSON_PARALLEL
+#endif
+
+#ifdef PYBIND11_JSON_PARALLEL
+#include <atomic>
+#include <exception>
+#include <thread>
+#endif
+
+// Per-conversion counters and timings, see conversion_stats. Without
+// PYBIND11_JSON_STATS the instrumentation compiles to nothing.
+#ifdef PYBIND11_JSON_STATS
+#include <chrono>
+
+#define PYBIND11_JSON_COUNT(event)                                                            \
+    do                                                                                        \
+    {                                                                                         \
+        if (::pyjson::detail::stats_state* pyjson_stats_ = ::pyjson::detail::current_stats()) \
+        {                                                                                     \
+            pyjson_stats_->event;                                                             \
+        }                                                                                     \
+    } while (false)
+#define PYBIND11_JSON_STATS_SCOPE(operation) ::pyjson::detail::stats_scope pyjson_stats_scope_(operation)
+#else
+#define PYBIND11_JSON_COUNT(event) do { } while (false)
+#define PYBIND11_JSON_STATS_SCOPE(operation) do { } while (false)
+#endif
+
+// nl::json::binary_t appeared in nlohmann_json 3.8.0
+#if NLOHMANN_JSON_VERSION_MAJOR > 3 || (NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR >= 8)
+#define PYBIND11_JSON_HAS_BINARY
+#endif
+
+// nl::ordered_json appeared in nlohmann_json 3.9.0
+#if NLOHMANN_JSON_VERSION_MAJOR > 3 || (NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR >= 9)
+#define PYBIND11_JSON_HAS_ORDERED_JSON
+#endif
+
+// std::to_chars for doubles, which gives the shortest round-trip digits
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define PYBIND11_JSON_HAS_TO_CHARS
+#endif
+
 namespace py = pybind11;
 namespace nl = nlohmann;
 
 namespace pyjson
 {
-    inline py::object from_json(const nl::json& j)
+#ifdef PYBIND11_JSON_STATS
+    /*
+     * What a conversion processed: nodes by type, bytes of strings (keys
+     * included), of bytes objects written as base64 and of binary values,
+     * the deepest nesting and the largest container, and the time spent.
+     * Bytes written as base64 also count as strings.
+     */
+    struct conversion_stats
+    {
+        std::uint64_t conversions = 0;
+        std::uint64_t nulls = 0;
+        std::uint64_t booleans = 0;
+        std::uint64_t integers = 0;
+        std::uint64_t floats = 0;
+        std::uint64_t strings = 0;
+        std::uint64_t binaries = 0;
+        std::uint64_t arrays = 0;
+        std::uint64_t objects = 0;
+        std::uint64_t keys = 0;
+        std::uint64_t string_bytes = 0;
+        std::uint64_t base64_bytes = 0;
+        std::uint64_t binary_bytes = 0;
+        std::uint64_t max_depth = 0;
+        std::uint64_t max_container_size = 0;
+        std::uint64_t nanoseconds = 0;
+
+        conversion_stats& operator+=(const conversion_stats& other)
+        {
+            conversions += other.conversions;
+            nulls += other.nulls;
+            booleans += other.booleans;
+            integers += other.integers;
+            floats += other.floats;
+            strings += other.strings;
+            binaries += other.binaries;
+            arrays += other.arrays;
+            objects += other.objects;
+            keys += other.keys;
+            string_bytes += other.string_bytes;
+            base64_bytes += other.base64_bytes;
+            binary_bytes += other.binary_bytes;
+            max_depth = std::max(max_depth, other.max_depth);
+            max_container_size = std::max(max_container_size, other.max_container_size);
+            nanoseconds += other.nanoseconds;
+            return *this;
+        }
+    };
+
+    // Called at the end of each outermost conversion with its name
+    // ("to_json", "dump", "loads", "type_caster"...) and what it processed
+    using stats_callback = std::function<void(const char* operation, const conversion_stats& stats)>;
+
+    namespace detail
+    {
+        // Leaked on purpose, like the converters: the callback may hold
+        // Python objects.
+        inline stats_callback& stats_hook()
+        {
+            static auto* instance = new stats_callback();
+            return *instance;
+        }
+
+        // Counters of the conversion running on a thread
+        struct stats_state
+        {
+            conversion_stats stats;
+            std::uint64_t depth = 0;
+
+            void null() { ++stats.nulls; }
+            void boolean() { ++stats.booleans; }
+            void integer() { ++stats.integers; }
+            void floating() { ++stats.floats; }
+
+            void string(std::size_t size)
+            {
+                ++stats.strings;
+                stats.string_bytes += size;
+            }
+
+            void key(std::size_t size)
+            {
+                ++stats.keys;
+                stats.string_bytes += size;
+            }
+
+            void binary(std::size_t size)
+            {
+                ++stats.binaries;
+                stats.binary_bytes += size;
+            }
+
+            void base64(std::size_t size)
+            {
+                stats.base64_bytes += size;
+            }
+
+            // Sizes unknown until the end, e.g. while parsing text, are -1
+            void start(bool object, std::size_t size)
+            {
+                ++(object ? stats.objects : stats.arrays);
+                stats.max_depth = std::max(stats.max_depth, ++depth);
+                sized(size);
+            }
+
+            void end(std::size_t size)
+            {
+                --depth;
+                sized(size);
+            }
+
+            void sized(std::size_t size)
+            {
+                if (size != static_cast<std::size_t>(-1))
+                {
+                    stats.max_container_size = std::max<std::uint64_t>(stats.max_container_size, size);
+                }
+            }
+        };
+
+        inline stats_state*& current_stats()
+        {
+            static thread_local stats_state* instance = nullptr;
+            return instance;
+        }
+    }
+
+    // Sum of the conversions of the current thread, which may be reset
+    inline conversion_stats& thread_stats()
+    {
+        static thread_local conversion_stats instance;
+        return instance;
+    }
+
+    // Reset it with an empty callback before finalizing the interpreter
+    inline void set_stats_callback(stats_callback callback)
+    {
+        detail::stats_hook() = std::move(callback);
+    }
+
+    inline py::dict stats_dict(const conversion_stats& stats)
+    {
+        py::dict out;
+        out["conversions"] = py::int_(stats.conversions);
+        out["nulls"] = py::int_(stats.nulls);
+        out["booleans"] = py::int_(stats.booleans);
+        out["integers"] = py::int_(stats.integers);
+        out["floats"] = py::int_(stats.floats);
+        out["strings"] = py::int_(stats.strings);
+        out["binaries"] = py::int_(stats.binaries);
+        out["arrays"] = py::int_(stats.arrays);
+        out["objects"] = py::int_(stats.objects);
+        out["keys"] = py::int_(stats.keys);
+        out["string_bytes"] = py::int_(stats.string_bytes);
+        out["base64_bytes"] = py::int_(stats.base64_bytes);
+        out["binary_bytes"] = py::int_(stats.binary_bytes);
+        out["max_depth"] = py::int_(stats.max_depth);
+        out["max_container_size"] = py::int_(stats.max_container_size);
+        out["nanoseconds"] = py::int_(stats.nanoseconds);
+        return out;
+    }
+
+    namespace detail
+    {
+        /*
+         * Collects the stats of the outermost conversion of a thread: nested
+         * conversions (converters, type casters, memoized containers...)
+         * count into it. At the end, the stats are added to thread_stats and
+         * given to the callback, whose exceptions are ignored.
+         */
+        class stats_scope
+        {
+        public:
+            explicit stats_scope(const char* operation)
+                : m_operation(operation), m_owner(current_stats() == nullptr)
+            {
+                if (m_owner)
+                {
+                    current_stats() = &m_state;
+                    m_start = std::chrono::steady_clock::now();
+                }
+            }
+
+            stats_scope(const stats_scope&) = delete;
+            stats_scope& operator=(const stats_scope&) = delete;
+
+            ~stats_scope()
+            {
+                if (!m_owner)
+                {
+                    return;
+                }
+                current_stats() = nullptr;
+                m_state.stats.conversions = 1;
+                m_state.stats.nanoseconds = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - m_start).count());
+                thread_stats() += m_state.stats;
+                const stats_callback& callback = stats_hook();
+                if (callback)
+                {
+                    try
+                    {
+                        callback(m_operation, m_state.stats);
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+            }
+
+        private:
+
+            const char* m_operation;
+            bool m_owner;
+            stats_state m_state;
+            std::chrono::steady_clock::time_point m_start;
+        };
+
+        /*
+         * Counts the work of one thread of a parallel conversion apart, and
+         * adds it to the conversion's stats at the end.
+         */
+        class stats_fork
+        {
+        public:
+            stats_fork(stats_state* parent, std::mutex& mutex)
+                : m_parent(parent), m_mutex(mutex), m_previous(current_stats())
+            {
+                if (m_parent != nullptr)
+                {
+                    m_state.depth = m_parent->depth;
+                    current_stats() = &m_state;
+                }
+            }
+
+            stats_fork(const stats_fork&) = delete;
+            stats_fork& operator=(const stats_fork&) = delete;
+
+            ~stats_fork()
+            {
+                if (m_parent != nullptr)
+                {
+                    current_stats() = m_previous;
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_parent->stats += m_state.stats;
+                }
+            }
+
+        private:
+
+            stats_state* m_parent;
+            std::mutex& m_mutex;
+            stats_state* m_previous;
+            stats_state m_state;
+        };
+
+        // Counts the events of a py_walker before passing them on
+        template <class Handler>
+        class counting_handler
+        {
+        public:
+            explicit counting_handler(Handler& handler)
+                : m_handler(handler), m_state(current_stats() != nullptr ? current_stats() : &m_ignored)
+            {
+            }
+
+            void null()
+            {
+                m_state->null();
+                m_handler.null();
+            }
+
+            void boolean(bool val)
+            {
+                m_state->boolean();
+                m_handler.boolean(val);
+            }
+
+            void number_integer(nl::json::number_integer_t val)
+            {
+                m_state->integer();
+                m_handler.number_integer(val);
+            }
+
+            void number_unsigned(nl::json::number_unsigned_t val)
+            {
+                m_state->integer();
+                m_handler.number_unsigned(val);
+            }
+
+            void number_float(double val)
+            {
+                m_state->floating();
+                m_handler.number_float(val);
+            }
+
+            void string(const char* data, std::size_t size)
+            {
+                m_state->string(size);
+                m_handler.string(data, size);
+            }
+
+            void binary(const char* data, std::size_t size)
+            {
+                m_state->binary(size);
+                m_handler.binary(data, size);
+            }
+
+            void start_array(std::size_t size)
+            {
+                m_state->start(false, size);
+                m_handler.start_array(size);
+            }
+
+            void end_array()
+            {
+                m_state->end(static_cast<std::size_t>(-1));
+                m_handler.end_array();
+            }
+
+            void start_object(std::size_t size)
+            {
+                m_state->start(true, size);
+                m_handler.start_object(size);
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                m_state->key(size);
+                m_handler.key(data, size);
+            }
+
+            void end_object()
+            {
+                m_state->end(static_cast<std::size_t>(-1));
+                m_handler.end_object();
+            }
+
+            // Copies of memoized containers, counted when they were built
+            template <class Json>
+            void value(const Json& val)
+            {
+                m_handler.value(val);
+            }
+
+            void base64(std::size_t size)
+            {
+                m_state->base64(size);
+            }
+
+        private:
+
+            Handler& m_handler;
+            stats_state m_ignored;
+            stats_state* m_state;
+        };
+    }
+#endif
+
+    namespace detail
+    {
+        inline py::str make_str(const char* data, std::size_t size)
+        {
+            PyObject* obj = PyUnicode_FromStringAndSize(data, static_cast<Py_ssize_t>(size));
+            if (obj == nullptr)
+            {
+                throw py::error_already_set();
+            }
+            return py::reinterpret_steal<py::str>(obj);
+        }
+
+        template <class String>
+        inline py::str make_str(const String& val)
+        {
+            return make_str(val.data(), val.size());
+        }
+
+        // Py_buffer released on scope exit
+        class buffer_view
+        {
+        public:
+            buffer_view(PyObject* obj, int flags)
+            {
+                if (PyObject_GetBuffer(obj, &m_view, flags) != 0)
+                {
+                    throw py::error_already_set();
+                }
+            }
+
+            buffer_view(const buffer_view&) = delete;
+            buffer_view& operator=(const buffer_view&) = delete;
+
+            ~buffer_view()
+            {
+                PyBuffer_Release(&m_view);
+            }
+
+            const Py_buffer& get() const
+            {
+                return m_view;
+            }
+
+        private:
+
+            Py_buffer m_view;
+        };
+
+        inline bool is_little_endian()
+        {
+            const std::uint16_t probe = 1;
+            return *reinterpret_cast<const std::uint8_t*>(&probe) == 1;
+        }
+
+        /*
+         * Kind of the items of a buffer: 'i' (signed), 'u' (unsigned), 'f'
+         * (floating point) or '?' (bool), from its struct format, or 0 when
+         * the items are not plain numbers in native byte order.
+         */
+        inline char buffer_kind(const Py_buffer& view)
+        {
+            const char* format = view.format != nullptr ? view.format : "B";
+            char order = '@';
+            if (std::strchr("@=<>!", *format) != nullptr)
+            {
+                order = *format++;
+            }
+            if (format[0] == '\0' || format[1] != '\0')
+            {
+                return 0;
+            }
+            if ((order == '<' && !is_little_endian()) || ((order == '>' || order == '!') && is_little_endian()))
+            {
+                return 0;
+            }
+
+            const Py_ssize_t size = view.itemsize;
+            const bool integral = size == 1 || size == 2 || size == 4 || size == 8;
+            if (std::strchr("bhilqn", format[0]) != nullptr && integral)
+            {
+                return 'i';
+            }
+            if (std::strchr("BHILQN", format[0]) != nullptr && integral)
+            {
+                return 'u';
+            }
+            if (std::strchr("fd", format[0]) != nullptr && (size == 4 || size == 8))
+            {
+                return 'f';
+            }
+            if (format[0] == '?' && size == 1)
+            {
+                return '?';
+            }
+            return 0;
+        }
+
+        // Any basic_json specialization (nl::json, nl::ordered_json, custom
+        // number, string or allocator types)
+        template <class T>
+        using enable_if_basic_json_t = typename std::enable_if<nl::detail::is_basic_json<T>::value, int>::type;
+    }
+
+    /*
+     * Cache of interned Python strings for object keys, used by from_json
+     * and loads. Documents made of many records sharing the same keys then
+     * create each key once and reuse it, and the resulting dicts use
+     * interned keys. A cache can be used for a single conversion or kept
+     * across calls; it holds Python references, so it must be destroyed
+     * with the GIL held.
+     */
+    class key_cache
     {
-        if (j.is_null())
+    public:
+        explicit key_cache(std::size_t max_size = 4096, std::size_t max_key_size = 64)
+            : m_max_size(max_size), m_max_key_size(max_key_size)
+        {
+        }
+
+        py::str get(const nl::json::string_t& key)
         {
-            return py::none();
+            if (key.size() > m_max_key_size)
+            {
+                return detail::make_str(key);
+            }
+
+            auto it = m_keys.find(key);
+            if (it != m_keys.end())
+            {
+                return it->second;
+            }
+
+            // Interned strings are never released, so only the keys which
+            // the cache keeps are interned
+            if (m_keys.size() >= m_max_size)
+            {
+                return detail::make_str(key);
+            }
+
+            PyObject* interned = detail::make_str(key).release().ptr();
+            PyUnicode_InternInPlace(&interned);
+            py::str obj = py::reinterpret_steal<py::str>(interned);
+            m_keys.emplace(key, obj);
+            return obj;
         }
-        else if (j.is_boolean())
+
+        std::size_t size() const
         {
-            return py::bool_(j.get<bool>());
+            return m_keys.size();
         }
-        else if (j.is_number_unsigned())
+
+        void clear()
         {
-            return py::int_(j.get<nl::json::number_unsigned_t>());
+            m_keys.clear();
         }
-        else if (j.is_number_integer())
+
+    private:
+
+        std::unordered_map<nl::json::string_t, py::str> m_keys;
+        std::size_t m_max_size;
+        std::size_t m_max_key_size;
+    };
+
+    struct from_json_options
+    {
+        // Turn non-empty arrays of numbers, possibly nested with a regular
+        // shape, into numpy.ndarray of float64, int64 or uint64. Other
+        // arrays holding arrays (e.g. ragged ones) stay lists all the way
+        // down, rather than becoming lists of ndarrays.
+        bool numpy_arrays = false;
+    };
+
+    namespace detail
+    {
+        inline py::str make_key(const nl::json::string_t& key, key_cache* keys)
         {
-            return py::int_(j.get<nl::json::number_integer_t>());
+            return keys != nullptr ? keys->get(key) : make_str(key);
         }
-        else if (j.is_number_float())
+
+        // Keys of a custom string type bypass the cache
+        template <class String>
+        inline py::str make_key(const String& key, key_cache*)
         {
-            return py::float_(j.get<double>());
+            return make_str(key);
         }
-        else if (j.is_string())
+
+        struct numeric_leaves
+        {
+            bool has_float = false;
+            bool has_negative = false;
+            bool has_large = false; // above the int64 range
+        };
+
+        template <class BasicJsonType>
+        inline bool check_numeric(const BasicJsonType& j, const std::vector<Py_ssize_t>& shape, std::size_t dim, numeric_leaves& leaves)
         {
-            return py::str(j.get<std::string>());
+            if (dim == shape.size())
+            {
+                if (j.is_number_float())
+                {
+                    leaves.has_float = true;
+                }
+                else if (j.is_number_unsigned())
+                {
+                    leaves.has_large |= j.template get<std::uint64_t>() > static_cast<std::uint64_t>((std::numeric_limits<std::int64_t>::max)());
+                }
+                else if (j.is_number_integer())
+                {
+                    leaves.has_negative |= j.template get<std::int64_t>() < 0;
+                }
+                else
+                {
+                    return false;
+                }
+                return true;
+            }
+
+            if (!j.is_array() || static_cast<Py_ssize_t>(j.size()) != shape[dim])
+            {
+                return false;
+            }
+            for (const BasicJsonType& item : j)
+            {
+                if (!check_numeric(item, shape, dim + 1, leaves))
+                {
+                    return false;
+                }
+            }
+            return true;
         }
-        else if (j.is_array())
+
+        template <class BasicJsonType>
+        inline void fill_ndarray(const BasicJsonType& j, std::size_t depth, char kind, char*& out)
+        {
+            if (depth != 0)
+            {
+                for (const BasicJsonType& item : j)
+                {
+                    fill_ndarray(item, depth - 1, kind, out);
+                }
+                return;
+            }
+
+            if (kind == 'f')
+            {
+                double val = j.template get<double>();
+                std::memcpy(out, &val, sizeof(val));
+            }
+            else if (kind == 'i')
+            {
+                std::int64_t val = j.template get<std::int64_t>();
+                std::memcpy(out, &val, sizeof(val));
+            }
+            else
+            {
+                std::uint64_t val = j.template get<std::uint64_t>();
+                std::memcpy(out, &val, sizeof(val));
+            }
+            out += 8;
+        }
+
+        /*
+         * Converts a non-empty array of numbers, possibly nested with a
+         * regular shape, into a numpy.ndarray of float64, int64 or uint64.
+         * Returns a null object for any other array.
+         */
+        template <class BasicJsonType>
+        inline py::object to_ndarray(const BasicJsonType& j)
+        {
+            std::vector<Py_ssize_t> shape;
+            for (const BasicJsonType* node = &j; node->is_array(); node = &node->front())
+            {
+                if (node->empty())
+                {
+                    return py::object();
+                }
+                shape.push_back(static_cast<Py_ssize_t>(node->size()));
+            }
+
+            numeric_leaves leaves;
+            if (!check_numeric(j, shape, 0, leaves) || (leaves.has_large && leaves.has_negative && !leaves.has_float))
+            {
+                return py::object();
+            }
+            const char kind = leaves.has_float ? 'f' : (leaves.has_large ? 'u' : 'i');
+
+            py::tuple dims(shape.size());
+            for (std::size_t i = 0; i < shape.size(); ++i)
+            {
+                PyTuple_SET_ITEM(dims.ptr(), static_cast<Py_ssize_t>(i), py::int_(shape[i]).release().ptr());
+            }
+            const char* dtype = kind == 'f' ? "float64" : (kind == 'i' ? "int64" : "uint64");
+            py::object array = py::module::import("numpy").attr("empty")(dims, dtype);
+
+            buffer_view buffer(array.ptr(), PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS);
+            char* out = static_cast<char*>(buffer.get().buf);
+            fill_ndarray(j, shape.size(), kind, out);
+            return array;
+        }
+
+        template <class Json, class T>
+        using copy_const_t = typename std::conditional<std::is_const<Json>::value, const T, T>::type;
+
+        // When converting from an rvalue, subtrees are released as soon as
+        // they have been converted to keep the peak memory down.
+        template <class BasicJsonType>
+        inline void release_subtree(const BasicJsonType&)
+        {
+        }
+
+        template <class BasicJsonType>
+        inline void release_subtree(BasicJsonType& j)
+        {
+            j = nullptr;
+        }
+
+        template <class Json>
+        inline py::object from_json(Json& j, key_cache* keys, const from_json_options& opts)
+        {
+            using json_type = typename std::remove_const<Json>::type;
+
+            if (j.is_null())
+            {
+                PYBIND11_JSON_COUNT(null());
+                return py::none();
+            }
+            else if (j.is_boolean())
+            {
+                PYBIND11_JSON_COUNT(boolean());
+                return py::bool_(j.template get<bool>());
+            }
+            else if (j.is_number_unsigned())
+            {
+                PYBIND11_JSON_COUNT(integer());
+                return py::int_(j.template get<typename json_type::number_unsigned_t>());
+            }
+            else if (j.is_number_integer())
+            {
+                PYBIND11_JSON_COUNT(integer());
+                return py::int_(j.template get<typename json_type::number_integer_t>());
+            }
+            else if (j.is_number_float())
+            {
+                PYBIND11_JSON_COUNT(floating());
+                return py::float_(j.template get<double>());
+            }
+            else if (j.is_string())
+            {
+                const typename json_type::string_t& str = j.template get_ref<const typename json_type::string_t&>();
+                PYBIND11_JSON_COUNT(string(str.size()));
+                return make_str(str);
+            }
+#ifdef PYBIND11_JSON_HAS_BINARY
+            else if (j.is_binary())
+            {
+                const typename json_type::binary_t& binary = j.get_binary();
+                PYBIND11_JSON_COUNT(binary(binary.size()));
+                return py::bytes(reinterpret_cast<const char*>(binary.data()), binary.size());
+            }
+#endif
+            else if (j.is_array())
+            {
+                PYBIND11_JSON_COUNT(start(false, j.size()));
+                auto& array = j.template get_ref<copy_const_t<Json, typename json_type::array_t>&>();
+                const from_json_options* item_opts = &opts;
+                from_json_options plain = opts;
+                if (opts.numpy_arrays)
+                {
+                    py::object ndarray = to_ndarray(j);
+                    if (ndarray)
+                    {
+                        PYBIND11_JSON_COUNT(end(j.size()));
+                        return ndarray;
+                    }
+                    if (std::any_of(array.begin(), array.end(), [](const json_type& item) { return item.is_array(); }))
+                    {
+                        plain.numpy_arrays = false;
+                        item_opts = &plain;
+                    }
+                }
+
+                py::list obj(array.size());
+                for (std::size_t i = 0; i < array.size(); i++)
+                {
+                    PyList_SET_ITEM(obj.ptr(), static_cast<Py_ssize_t>(i), from_json(array[i], keys, *item_opts).release().ptr());
+                    release_subtree(array[i]);
+                }
+                PYBIND11_JSON_COUNT(end(array.size()));
+                return obj;
+            }
+            else // Object
+            {
+                PYBIND11_JSON_COUNT(start(true, j.size()));
+                py::dict obj;
+                for (auto& item : j.template get_ref<copy_const_t<Json, typename json_type::object_t>&>())
+                {
+                    PYBIND11_JSON_COUNT(key(item.first.size()));
+                    py::str key = make_key(item.first, keys);
+                    py::object value = from_json(item.second, keys, opts);
+                    if (PyDict_SetItem(obj.ptr(), key.ptr(), value.ptr()) != 0)
+                    {
+                        throw py::error_already_set();
+                    }
+                    release_subtree(item.second);
+                }
+                PYBIND11_JSON_COUNT(end(static_cast<std::size_t>(-1)));
+                return obj;
+            }
+        }
+    }
+
+    template <class BasicJsonType, detail::enable_if_basic_json_t<BasicJsonType> = 0>
+    inline py::object from_json(const BasicJsonType& j, const from_json_options& opts = from_json_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("from_json");
+        return detail::from_json(j, nullptr, opts);
+    }
+
+    template <class BasicJsonType, detail::enable_if_basic_json_t<BasicJsonType> = 0>
+    inline py::object from_json(const BasicJsonType& j, key_cache& keys, const from_json_options& opts = from_json_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("from_json");
+        return detail::from_json(j, &keys, opts);
+    }
+
+    // Converts the value at `ptr`; throws nl::json::out_of_range when there is none
+    template <class BasicJsonType, detail::enable_if_basic_json_t<BasicJsonType> = 0>
+    inline py::object from_json(const BasicJsonType& j, const typename BasicJsonType::json_pointer& ptr,
+                                const from_json_options& opts = from_json_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("from_json");
+        return detail::from_json(j.at(ptr), nullptr, opts);
+    }
+
+    /*
+     * Converts a JSON value that is no longer needed: its subtrees are freed
+     * as soon as they are converted and `j` is left null.
+     */
+    template <class BasicJsonType, detail::enable_if_basic_json_t<BasicJsonType> = 0>
+    inline py::object from_json(BasicJsonType&& j, const from_json_options& opts = from_json_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("from_json");
+        py::object obj = detail::from_json(j, nullptr, opts);
+        j = nullptr;
+        return obj;
+    }
+
+    template <class BasicJsonType, detail::enable_if_basic_json_t<BasicJsonType> = 0>
+    inline py::object from_json(BasicJsonType&& j, key_cache& keys, const from_json_options& opts = from_json_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("from_json");
+        py::object obj = detail::from_json(j, &keys, opts);
+        j = nullptr;
+        return obj;
+    }
+
+    namespace detail
+    {
+        /*
+         * nlohmann SAX handler creating Python objects as parse events
+         * arrive, so that loading JSON text does not go through an nl::json
+         * tree first.
+         */
+        class py_builder
+        {
+        public:
+            explicit py_builder(key_cache* keys = nullptr)
+                : m_keys(keys)
+            {
+            }
+
+            bool null()
+            {
+                PYBIND11_JSON_COUNT(null());
+                return put(py::none());
+            }
+
+            bool boolean(bool val)
+            {
+                PYBIND11_JSON_COUNT(boolean());
+                return put(py::bool_(val));
+            }
+
+            bool number_integer(nl::json::number_integer_t val)
+            {
+                PYBIND11_JSON_COUNT(integer());
+                return put(py::int_(val));
+            }
+
+            bool number_unsigned(nl::json::number_unsigned_t val)
+            {
+                PYBIND11_JSON_COUNT(integer());
+                return put(py::int_(val));
+            }
+
+            bool number_float(nl::json::number_float_t val, const nl::json::string_t&)
+            {
+                PYBIND11_JSON_COUNT(floating());
+                return put(py::float_(val));
+            }
+
+            bool string(nl::json::string_t& val)
+            {
+                PYBIND11_JSON_COUNT(string(val.size()));
+                return put(make_str(val));
+            }
+
+            template <class Binary>
+            bool binary(Binary& val)
+            {
+                PYBIND11_JSON_COUNT(binary(val.size()));
+                return put(py::bytes(reinterpret_cast<const char*>(val.data()), val.size()));
+            }
+
+            bool start_object(std::size_t)
+            {
+                PYBIND11_JSON_COUNT(start(true, static_cast<std::size_t>(-1)));
+                py::dict obj;
+                put(obj);
+                m_stack.push_back(std::move(obj));
+                return true;
+            }
+
+            bool key(nl::json::string_t& val)
+            {
+                PYBIND11_JSON_COUNT(key(val.size()));
+                m_key = make_key(val, m_keys);
+                return true;
+            }
+
+            bool end_object()
+            {
+                PYBIND11_JSON_COUNT(end(static_cast<std::size_t>(PyDict_GET_SIZE(m_stack.back().ptr()))));
+                m_stack.pop_back();
+                return true;
+            }
+
+            bool start_array(std::size_t)
+            {
+                PYBIND11_JSON_COUNT(start(false, static_cast<std::size_t>(-1)));
+                py::list obj;
+                put(obj);
+                m_stack.push_back(std::move(obj));
+                return true;
+            }
+
+            bool end_array()
+            {
+                PYBIND11_JSON_COUNT(end(static_cast<std::size_t>(PyList_GET_SIZE(m_stack.back().ptr()))));
+                m_stack.pop_back();
+                return true;
+            }
+
+            template <class Exception>
+            bool parse_error(std::size_t, const std::string&, const Exception& ex)
+            {
+                throw ex;
+            }
+
+            py::object& result()
+            {
+                return m_root;
+            }
+
+        private:
+
+            bool put(const py::object& val)
+            {
+                if (m_stack.empty())
+                {
+                    m_root = val;
+                    return true;
+                }
+
+                const py::object& parent = m_stack.back();
+                int status = PyList_Check(parent.ptr())
+                    ? PyList_Append(parent.ptr(), val.ptr())
+                    : PyDict_SetItem(parent.ptr(), m_key.ptr(), val.ptr());
+                if (status != 0)
+                {
+                    throw py::error_already_set();
+                }
+                return true;
+            }
+
+            py::object m_root;
+            std::vector<py::object> m_stack;
+            py::object m_key;
+            key_cache* m_keys;
+        };
+    }
+
+    /*
+     * Parses JSON text straight into Python objects. The result is equal to
+     * from_json(nl::json::parse(text)); parse errors throw nl::json::parse_error.
+     */
+    namespace detail
+    {
+        inline py::object loads(const char* data, std::size_t size, key_cache* keys)
+        {
+            PYBIND11_JSON_STATS_SCOPE("loads");
+            py_builder builder(keys);
+            nl::json::sax_parse(data, data + size, &builder);
+            return std::move(builder.result());
+        }
+    }
+
+    inline py::object loads(const char* data, std::size_t size)
+    {
+        return detail::loads(data, size, nullptr);
+    }
+
+    inline py::object loads(const char* data, std::size_t size, key_cache& keys)
+    {
+        return detail::loads(data, size, &keys);
+    }
+
+    inline py::object loads(const char* text)
+    {
+        return loads(text, std::char_traits<char>::length(text));
+    }
+
+    inline py::object loads(const char* text, key_cache& keys)
+    {
+        return loads(text, std::char_traits<char>::length(text), keys);
+    }
+
+    inline py::object loads(const std::string& text)
+    {
+        return loads(text.data(), text.size());
+    }
+
+    inline py::object loads(const std::string& text, key_cache& keys)
+    {
+        return loads(text.data(), text.size(), keys);
+    }
+
+#ifdef PYBIND11_HAS_STRING_VIEW
+    inline py::object loads(std::string_view text)
+    {
+        return loads(text.data(), text.size());
+    }
+
+    inline py::object loads(std::string_view text, key_cache& keys)
+    {
+        return loads(text.data(), text.size(), keys);
+    }
+#endif
+
+    namespace detail
+    {
+        // Splits a JSON pointer into its unescaped reference tokens
+        inline std::vector<std::string> pointer_tokens(const std::string& pointer)
+        {
+            // Validates the syntax, throwing nl::json::parse_error
+            static_cast<void>(nl::json::json_pointer(pointer));
+
+            std::vector<std::string> tokens;
+            std::size_t start = 1;
+            while (start <= pointer.size() && !pointer.empty())
+            {
+                std::size_t end = pointer.find('/', start);
+                if (end == std::string::npos)
+                {
+                    end = pointer.size();
+                }
+                std::string token;
+                for (std::size_t i = start; i < end; ++i)
+                {
+                    if (pointer[i] == '~')
+                    {
+                        token.push_back(pointer[++i] == '0' ? '~' : '/');
+                    }
+                    else
+                    {
+                        token.push_back(pointer[i]);
+                    }
+                }
+                tokens.push_back(std::move(token));
+                start = end + 1;
+            }
+            return tokens;
+        }
+
+        /*
+         * SAX handler materializing only the values selected by a set of
+         * JSON pointers. Other subtrees are still validated by the parser,
+         * but create no Python object. Parsing stops once every selected
+         * value has been read.
+         */
+        class pointer_filter
+        {
+        public:
+
+            explicit pointer_filter(const std::vector<std::string>& pointers)
+            {
+                for (const std::string& pointer : pointers)
+                {
+                    node* current = &m_root;
+                    for (const std::string& token : pointer_tokens(pointer))
+                    {
+                        current = &current->children[token];
+                    }
+                    current->pointer = &pointer;
+                }
+                m_remaining = prepare(m_root);
+            }
+
+            bool null()
+            {
+                return scalar([](py_builder& b) { return b.null(); });
+            }
+
+            bool boolean(bool val)
+            {
+                return scalar([&](py_builder& b) { return b.boolean(val); });
+            }
+
+            bool number_integer(nl::json::number_integer_t val)
+            {
+                return scalar([&](py_builder& b) { return b.number_integer(val); });
+            }
+
+            bool number_unsigned(nl::json::number_unsigned_t val)
+            {
+                return scalar([&](py_builder& b) { return b.number_unsigned(val); });
+            }
+
+            bool number_float(nl::json::number_float_t val, const nl::json::string_t& text)
+            {
+                return scalar([&](py_builder& b) { return b.number_float(val, text); });
+            }
+
+            bool string(nl::json::string_t& val)
+            {
+                return scalar([&](py_builder& b) { return b.string(val); });
+            }
+
+            template <class Binary>
+            bool binary(Binary& val)
+            {
+                return scalar([&](py_builder& b) { return b.binary(val); });
+            }
+
+            bool start_object(std::size_t size)
+            {
+                return start([&](py_builder& b) { return b.start_object(size); }, false);
+            }
+
+            bool key(nl::json::string_t& val)
+            {
+                if (m_depth > 0)
+                {
+                    return m_builder.key(val);
+                }
+                if (m_skip == 0)
+                {
+                    m_frames.back().key = val;
+                }
+                return true;
+            }
+
+            bool end_object()
+            {
+                return end([](py_builder& b) { return b.end_object(); });
+            }
+
+            bool start_array(std::size_t size)
+            {
+                return start([&](py_builder& b) { return b.start_array(size); }, true);
+            }
+
+            bool end_array()
+            {
+                return end([](py_builder& b) { return b.end_array(); });
+            }
+
+            template <class Exception>
+            bool parse_error(std::size_t, const std::string&, const Exception& ex)
+            {
+                throw ex;
+            }
+
+            // Selected values by pointer; pointers within another selected
+            // value are resolved from it.
+            py::dict result(const std::vector<std::string>& pointers) const
+            {
+                py::dict values;
+                for (const std::string& pointer : pointers)
+                {
+                    const node* current = &m_root;
+                    py::object value = found(m_root);
+                    for (const std::string& token : pointer_tokens(pointer))
+                    {
+                        if (value)
+                        {
+                            value = child(value, token);
+                            if (!value)
+                            {
+                                break;
+                            }
+                        }
+                        else
+                        {
+                            current = &current->children.find(token)->second;
+                            value = found(*current);
+                        }
+                    }
+                    if (value)
+                    {
+                        values[py::str(pointer)] = value;
+                    }
+                }
+                return values;
+            }
+
+        private:
+
+            struct node
+            {
+                std::map<std::string, node> children;
+                // Children whose token is an array index, by index
+                std::vector<std::pair<std::size_t, const node*>> indices;
+                const std::string* pointer = nullptr;
+            };
+
+            // Array index token of RFC 6901: "0", or digits without a leading zero
+            static bool is_index(const std::string& token)
+            {
+                return token == "0" || (!token.empty() && token[0] != '0' && token.size() < 20 &&
+                                        token.find_first_not_of("0123456789") == std::string::npos);
+            }
+
+            // Fills the indices and counts the selected values which are not
+            // within another selected value
+            static std::size_t prepare(node& n)
+            {
+                std::size_t total = 0;
+                for (auto& item : n.children)
+                {
+                    if (is_index(item.first))
+                    {
+                        n.indices.emplace_back(std::stoull(item.first), &item.second);
+                    }
+                    total += prepare(item.second);
+                }
+                std::sort(n.indices.begin(), n.indices.end());
+                return n.pointer != nullptr ? 1 : total;
+            }
+
+            py::object found(const node& n) const
+            {
+                auto it = m_values.find(&n);
+                return it != m_values.end() ? it->second : py::object();
+            }
+
+            struct frame
+            {
+                const node* target;
+                bool array;
+                std::size_t index;
+                // Next entry of target->indices which may match
+                std::size_t cursor;
+                std::string key;
+            };
+
+            static py::object child(const py::object& parent, const std::string& token)
+            {
+                if (PyDict_Check(parent.ptr()))
+                {
+                    // Unescaped tokens may hold NUL characters
+                    py::object key = py::reinterpret_steal<py::object>(
+                        PyUnicode_FromStringAndSize(token.data(), static_cast<Py_ssize_t>(token.size())));
+                    if (!key)
+                    {
+                        // No key of a parsed document is invalid UTF-8
+                        if (PyErr_ExceptionMatches(PyExc_UnicodeDecodeError))
+                        {
+                            PyErr_Clear();
+                            return py::object();
+                        }
+                        throw py::error_already_set();
+                    }
+                    PyObject* item = PyDict_GetItemWithError(parent.ptr(), key.ptr());
+                    if (item == nullptr && PyErr_Occurred())
+                    {
+                        throw py::error_already_set();
+                    }
+                    return py::reinterpret_borrow<py::object>(item);
+                }
+                if (PyList_Check(parent.ptr()) && is_index(token))
+                {
+                    std::size_t index = std::stoull(token);
+                    if (index < static_cast<std::size_t>(PyList_GET_SIZE(parent.ptr())))
+                    {
+                        return py::reinterpret_borrow<py::object>(PyList_GET_ITEM(parent.ptr(), static_cast<Py_ssize_t>(index)));
+                    }
+                }
+                return py::object();
+            }
+
+            // Node selected for the value which starts, nullptr when it is
+            // outside all the pointers
+            const node* next_target()
+            {
+                if (m_frames.empty())
+                {
+                    return &m_root;
+                }
+                frame& parent = m_frames.back();
+                if (parent.array)
+                {
+                    const auto& indices = parent.target->indices;
+                    const std::size_t index = parent.index++;
+                    if (parent.cursor < indices.size() && indices[parent.cursor].first == index)
+                    {
+                        return indices[parent.cursor++].second;
+                    }
+                    return nullptr;
+                }
+                auto it = parent.target->children.find(parent.key);
+                return it != parent.target->children.end() ? &it->second : nullptr;
+            }
+
+            template <class Event>
+            bool scalar(Event&& event)
+            {
+                if (m_depth > 0)
+                {
+                    return event(m_builder);
+                }
+                if (m_skip > 0)
+                {
+                    return true;
+                }
+                const node* target = next_target();
+                if (target != nullptr && target->pointer != nullptr)
+                {
+                    event(m_builder);
+                    return store(*target);
+                }
+                return true;
+            }
+
+            template <class Event>
+            bool start(Event&& event, bool array)
+            {
+                if (m_depth > 0)
+                {
+                    ++m_depth;
+                    return event(m_builder);
+                }
+                if (m_skip > 0)
+                {
+                    ++m_skip;
+                    return true;
+                }
+                const node* target = next_target();
+                if (target == nullptr)
+                {
+                    m_skip = 1;
+                }
+                else if (target->pointer != nullptr)
+                {
+                    m_depth = 1;
+                    m_capture = target;
+                    event(m_builder);
+                }
+                else
+                {
+                    m_frames.push_back(frame{target, array, 0, 0, std::string()});
+                }
+                return true;
+            }
+
+            template <class Event>
+            bool end(Event&& event)
+            {
+                if (m_depth > 0)
+                {
+                    event(m_builder);
+                    return --m_depth > 0 || store(*m_capture);
+                }
+                if (m_skip > 0)
+                {
+                    --m_skip;
+                    return true;
+                }
+                m_frames.pop_back();
+                return true;
+            }
+
+            // Returns false to stop parsing once everything was found. A
+            // duplicate key read before that replaces the first value.
+            bool store(const node& target)
+            {
+                py::object& value = m_values[&target];
+                if (!value)
+                {
+                    --m_remaining;
+                }
+                value = std::move(m_builder.result());
+                m_builder = py_builder();
+                return m_remaining > 0;
+            }
+
+            node m_root;
+            std::size_t m_remaining = 0;
+            std::vector<frame> m_frames;
+            std::size_t m_skip = 0;
+            std::size_t m_depth = 0;
+            const node* m_capture = nullptr;
+            py_builder m_builder;
+            std::map<const node*, py::object> m_values;
+        };
+    }
+
+    /*
+     * Parses only the values selected by JSON pointers, e.g. {"/data/items",
+     * "/meta/id"}, and returns them in a dict keyed by pointer. Pointers
+     * which match nothing are left out. The rest of the document creates no
+     * Python object, and the text after the last selected value is not
+     * parsed. Invalid pointers throw nl::json::parse_error.
+     */
+    inline py::dict loads(const char* data, std::size_t size, const std::vector<std::string>& pointers)
+    {
+        PYBIND11_JSON_STATS_SCOPE("loads");
+        detail::pointer_filter filter(pointers);
+        nl::json::sax_parse(data, data + size, &filter);
+        return filter.result(pointers);
+    }
+
+    inline py::dict loads(const std::string& text, const std::vector<std::string>& pointers)
+    {
+        return loads(text.data(), text.size(), pointers);
+    }
+
+    /*
+     * A read-only nl::json shared with Python. A bound function returning a
+     * json_view gives Python a lazy JsonObjectView or JsonArrayView instead
+     * of converting the whole document: values are converted when they are
+     * accessed and nested views are cached. Views taken as arguments share
+     * their document instead of converting it back.
+     */
+    class json_view
+    {
+    public:
+
+        json_view()
+            : json_view(nl::json())
+        {
+        }
+
+        explicit json_view(nl::json j)
+            : json_view(std::make_shared<const nl::json>(std::move(j)))
+        {
+        }
+
+        explicit json_view(std::shared_ptr<const nl::json> root)
+            : m_root(std::move(root)), m_node(m_root.get())
+        {
+        }
+
+        // `node` must belong to the document owned by `root`
+        json_view(std::shared_ptr<const nl::json> root, const nl::json& node)
+            : m_root(std::move(root)), m_node(&node)
+        {
+        }
+
+        const nl::json& json() const
+        {
+            return *m_node;
+        }
+
+        const std::shared_ptr<const nl::json>& root() const
+        {
+            return m_root;
+        }
+
+    private:
+
+        std::shared_ptr<const nl::json> m_root;
+        const nl::json* m_node;
+    };
+
+    namespace detail
+    {
+        struct view_object
+        {
+            PyObject_HEAD
+            std::shared_ptr<const nl::json> root;
+            const nl::json* node;
+            PyObject* children;
+        };
+
+        using view_root = std::shared_ptr<const nl::json>;
+
+        // Runs the body of a Python slot, turning C++ exceptions into a
+        // Python error and `error` as result.
+        template <class Result, class Function>
+        inline Result view_slot(Result error, Function&& f)
+        {
+            try
+            {
+                return f();
+            }
+            catch (py::error_already_set& e)
+            {
+                e.restore();
+            }
+            catch (const std::exception& e)
+            {
+                PyErr_SetString(PyExc_RuntimeError, e.what());
+            }
+            return error;
+        }
+
+        inline void view_dealloc(PyObject* self)
+        {
+            view_object* view = reinterpret_cast<view_object*>(self);
+            Py_XDECREF(view->children);
+            view->root.~view_root();
+            PyTypeObject* type = Py_TYPE(self);
+            type->tp_free(self);
+            Py_DECREF(type);
+        }
+
+        // Views of every interpreter share their deallocator
+        inline bool is_view(PyObject* obj)
+        {
+            return Py_TYPE(obj)->tp_dealloc == &view_dealloc;
+        }
+
+        inline const nl::json& view_node(PyObject* obj)
+        {
+            return *reinterpret_cast<view_object*>(obj)->node;
+        }
+
+        inline py::object make_view(const view_root& root, const nl::json& node);
+
+        // Scalars are converted on each access, structured values are
+        // wrapped once in a view cached under `key`.
+        inline PyObject* view_child(PyObject* self, PyObject* key, const nl::json& child)
+        {
+            if (!child.is_structured())
+            {
+                return detail::from_json(child, nullptr, from_json_options()).release().ptr();
+            }
+
+            view_object* view = reinterpret_cast<view_object*>(self);
+            PyObject* cached = PyDict_GetItemWithError(view->children, key);
+            if (cached != nullptr)
+            {
+                Py_INCREF(cached);
+                return cached;
+            }
+            if (PyErr_Occurred())
+            {
+                throw py::error_already_set();
+            }
+            py::object sub = make_view(view->root, child);
+            if (PyDict_SetItem(view->children, key, sub.ptr()) < 0)
+            {
+                throw py::error_already_set();
+            }
+            return sub.release().ptr();
+        }
+
+        inline PyObject* view_new(PyTypeObject* type, PyObject*, PyObject*)
+        {
+            PyErr_Format(PyExc_TypeError, "cannot create '%s' instances", type->tp_name);
+            return nullptr;
+        }
+
+        inline Py_ssize_t view_length(PyObject* self)
+        {
+            return static_cast<Py_ssize_t>(view_node(self).size());
+        }
+
+        inline PyObject* view_repr(PyObject* self)
+        {
+            return PyUnicode_FromFormat("<%s of %zd items>", Py_TYPE(self)->tp_name, view_length(self));
+        }
+
+        inline PyObject* view_to_python(PyObject* self, PyObject*)
+        {
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                return detail::from_json(view_node(self), nullptr, from_json_options()).release().ptr();
+            });
+        }
+
+        inline PyObject* view_richcompare(PyObject* self, PyObject* other, int op)
+        {
+            if (op != Py_EQ && op != Py_NE)
+            {
+                Py_RETURN_NOTIMPLEMENTED;
+            }
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                bool equal = false;
+                if (is_view(other))
+                {
+                    equal = view_node(self) == view_node(other);
+                }
+                else
+                {
+                    py::object converted = detail::from_json(view_node(self), nullptr, from_json_options());
+                    int result = PyObject_RichCompareBool(converted.ptr(), other, Py_EQ);
+                    if (result < 0)
+                    {
+                        throw py::error_already_set();
+                    }
+                    equal = result != 0;
+                }
+                return py::bool_(equal == (op == Py_EQ)).release().ptr();
+            });
+        }
+
+        // Returns nullptr without setting an error when the key is missing
+        inline PyObject* object_view_find(PyObject* self, PyObject* key)
+        {
+            if (!PyUnicode_Check(key))
+            {
+                return nullptr;
+            }
+            Py_ssize_t size = 0;
+            const char* data = PyUnicode_AsUTF8AndSize(key, &size);
+            if (data == nullptr)
+            {
+                throw py::error_already_set();
+            }
+            const nl::json& node = view_node(self);
+            auto it = node.find(std::string(data, static_cast<std::size_t>(size)));
+            if (it == node.end())
+            {
+                return nullptr;
+            }
+            return view_child(self, key, *it);
+        }
+
+        inline PyObject* object_view_subscript(PyObject* self, PyObject* key)
+        {
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                PyObject* value = object_view_find(self, key);
+                if (value == nullptr && !PyErr_Occurred())
+                {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                return value;
+            });
+        }
+
+        inline int object_view_contains(PyObject* self, PyObject* key)
+        {
+            return view_slot<int>(-1, [&]()
+            {
+                if (!PyUnicode_Check(key))
+                {
+                    return 0;
+                }
+                Py_ssize_t size = 0;
+                const char* data = PyUnicode_AsUTF8AndSize(key, &size);
+                if (data == nullptr)
+                {
+                    throw py::error_already_set();
+                }
+                const nl::json& node = view_node(self);
+                return node.find(std::string(data, static_cast<std::size_t>(size))) != node.end() ? 1 : 0;
+            });
+        }
+
+        inline PyObject* object_view_keys(PyObject* self, PyObject*)
+        {
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                const nl::json& node = view_node(self);
+                py::list keys(node.size());
+                std::size_t index = 0;
+                for (auto it = node.begin(); it != node.end(); ++it)
+                {
+                    PyList_SET_ITEM(keys.ptr(), static_cast<Py_ssize_t>(index++), make_str(it.key()).release().ptr());
+                }
+                return keys.release().ptr();
+            });
+        }
+
+        inline PyObject* object_view_values(PyObject* self, PyObject*)
+        {
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                const nl::json& node = view_node(self);
+                py::list values(node.size());
+                std::size_t index = 0;
+                for (auto it = node.begin(); it != node.end(); ++it)
+                {
+                    py::str key = make_str(it.key());
+                    PyList_SET_ITEM(values.ptr(), static_cast<Py_ssize_t>(index++), view_child(self, key.ptr(), it.value()));
+                }
+                return values.release().ptr();
+            });
+        }
+
+        inline PyObject* object_view_items(PyObject* self, PyObject*)
+        {
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                const nl::json& node = view_node(self);
+                py::list items(node.size());
+                std::size_t index = 0;
+                for (auto it = node.begin(); it != node.end(); ++it)
+                {
+                    py::str key = make_str(it.key());
+                    py::object value = py::reinterpret_steal<py::object>(view_child(self, key.ptr(), it.value()));
+                    PyList_SET_ITEM(items.ptr(), static_cast<Py_ssize_t>(index++), py::make_tuple(key, value).release().ptr());
+                }
+                return items.release().ptr();
+            });
+        }
+
+        inline PyObject* object_view_get(PyObject* self, PyObject* args)
+        {
+            PyObject* key = nullptr;
+            PyObject* fallback = Py_None;
+            if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &fallback))
+            {
+                return nullptr;
+            }
+            return view_slot<PyObject*>(nullptr, [&]()
+            {
+                PyObject* value = object_view_find(self, key);
+                if (value == nullptr && !PyErr_Occurred())
+                {
+                    Py_INCREF(fallback);
+                    value = fallback;
+                }
+                return value;
+            });
+        }
+
+        inline PyObject* object_view_iter(PyObject* self)
+        {
+            py::object keys = py::reinterpret_steal<py::object>(object_view_keys(self, nullptr));
+            return keys ? PyObject_GetIter(keys.ptr()) : nullptr;
+        }
+
+        // Also the sq_item slot: PySequence_GetItem has already added the
+        // length to a negative index, which is then out of range
+        inline PyObject* array_view_item(PyObject* self, Py_ssize_t index)
+        {
+            return view_slot<PyObject*>(nullptr, [&]() -> PyObject*
+            {
+                const nl::json& node = view_node(self);
+                const Py_ssize_t size = static_cast<Py_ssize_t>(node.size());
+                if (index < 0 || index >= size)
+                {
+                    PyErr_SetString(PyExc_IndexError, "JSON array index out of range");
+                    return nullptr;
+                }
+                py::object key = py::reinterpret_steal<py::object>(PyLong_FromSsize_t(index));
+                return view_child(self, key.ptr(), node[static_cast<std::size_t>(index)]);
+            });
+        }
+
+        inline PyObject* array_view_subscript(PyObject* self, PyObject* key)
+        {
+            if (PyIndex_Check(key))
+            {
+                Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+                if (index == -1 && PyErr_Occurred())
+                {
+                    return nullptr;
+                }
+                if (index < 0)
+                {
+                    index += view_length(self);
+                }
+                return array_view_item(self, index);
+            }
+            if (!PySlice_Check(key))
+            {
+                PyErr_Format(PyExc_TypeError, "JSON array indices must be integers or slices, not %s", Py_TYPE(key)->tp_name);
+                return nullptr;
+            }
+
+            Py_ssize_t start = 0;
+            Py_ssize_t stop = 0;
+            Py_ssize_t step = 0;
+            if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+            {
+                return nullptr;
+            }
+            const Py_ssize_t count = PySlice_AdjustIndices(view_length(self), &start, &stop, step);
+            PyObject* items = PyList_New(count);
+            if (items == nullptr)
+            {
+                return nullptr;
+            }
+            for (Py_ssize_t i = 0; i < count; ++i)
+            {
+                PyObject* item = array_view_item(self, start + i * step);
+                if (item == nullptr)
+                {
+                    Py_DECREF(items);
+                    return nullptr;
+                }
+                PyList_SET_ITEM(items, i, item);
+            }
+            return items;
+        }
+
+        inline int array_view_contains(PyObject* self, PyObject* value)
+        {
+            const Py_ssize_t size = view_length(self);
+            for (Py_ssize_t i = 0; i < size; ++i)
+            {
+                PyObject* item = array_view_item(self, i);
+                if (item == nullptr)
+                {
+                    return -1;
+                }
+                int result = PyObject_RichCompareBool(item, value, Py_EQ);
+                Py_DECREF(item);
+                if (result != 0)
+                {
+                    return result;
+                }
+            }
+            return 0;
+        }
+
+        struct view_types
+        {
+            PyTypeObject* object;
+            PyTypeObject* array;
+        };
+
+        inline PyTypeObject* make_view_type(const char* name, PyType_Slot* slots, const char* abc)
+        {
+            PyType_Spec spec = {name, static_cast<int>(sizeof(view_object)), 0, Py_TPFLAGS_DEFAULT, slots};
+            py::object type = py::reinterpret_steal<py::object>(PyType_FromSpec(&spec));
+            if (!type)
+            {
+                throw py::error_already_set();
+            }
+            py::module::import("collections.abc").attr(abc).attr("register")(type);
+            return reinterpret_cast<PyTypeObject*>(type.release().ptr());
+        }
+
+        // The view types are created once per interpreter, and kept in the
+        // pybind11 shared data so that all the modules of the interpreter use
+        // the same types.
+        inline view_types get_view_types()
+        {
+            static const char* const id = "_pybind11_json_view_types";
+            void* types = py::get_shared_data(id);
+#ifdef Py_GIL_DISABLED
+            // Keeps two threads from creating the types at once. A PyMutex
+            // detaches the waiting thread, so that it cannot block the
+            // interpreter while the types are created.
+            static PyMutex mutex = {0};
+            struct mutex_guard
+            {
+                mutex_guard() { PyMutex_Lock(&mutex); }
+                ~mutex_guard() { PyMutex_Unlock(&mutex); }
+            };
+            std::unique_ptr<mutex_guard> guard;
+            if (types == nullptr)
+            {
+                guard.reset(new mutex_guard());
+                types = py::get_shared_data(id);
+            }
+#endif
+            if (types == nullptr)
+            {
+                static PyMethodDef object_methods[] = {
+                    {"keys", &object_view_keys, METH_NOARGS, "List of the keys"},
+                    {"values", &object_view_values, METH_NOARGS, "List of the values"},
+                    {"items", &object_view_items, METH_NOARGS, "List of the (key, value) pairs"},
+                    {"get", &object_view_get, METH_VARARGS, "Value of a key, or a default when it is missing"},
+                    {"to_python", &view_to_python, METH_NOARGS, "Converts the whole view to a dict"},
+                    {nullptr, nullptr, 0, nullptr}
+                };
+                static PyType_Slot object_slots[] = {
+                    {Py_tp_doc, const_cast<char*>("Read-only lazy view of a JSON object")},
+                    {Py_tp_new, reinterpret_cast<void*>(&view_new)},
+                    {Py_tp_dealloc, reinterpret_cast<void*>(&view_dealloc)},
+                    {Py_tp_repr, reinterpret_cast<void*>(&view_repr)},
+                    {Py_tp_richcompare, reinterpret_cast<void*>(&view_richcompare)},
+                    {Py_tp_hash, reinterpret_cast<void*>(&PyObject_HashNotImplemented)},
+                    {Py_tp_iter, reinterpret_cast<void*>(&object_view_iter)},
+                    {Py_tp_methods, object_methods},
+                    {Py_mp_length, reinterpret_cast<void*>(&view_length)},
+                    {Py_mp_subscript, reinterpret_cast<void*>(&object_view_subscript)},
+                    {Py_sq_contains, reinterpret_cast<void*>(&object_view_contains)},
+                    {0, nullptr}
+                };
+                static PyMethodDef array_methods[] = {
+                    {"to_python", &view_to_python, METH_NOARGS, "Converts the whole view to a list"},
+                    {nullptr, nullptr, 0, nullptr}
+                };
+                static PyType_Slot array_slots[] = {
+                    {Py_tp_doc, const_cast<char*>("Read-only lazy view of a JSON array")},
+                    {Py_tp_new, reinterpret_cast<void*>(&view_new)},
+                    {Py_tp_dealloc, reinterpret_cast<void*>(&view_dealloc)},
+                    {Py_tp_repr, reinterpret_cast<void*>(&view_repr)},
+                    {Py_tp_richcompare, reinterpret_cast<void*>(&view_richcompare)},
+                    {Py_tp_hash, reinterpret_cast<void*>(&PyObject_HashNotImplemented)},
+                    {Py_tp_methods, array_methods},
+                    {Py_mp_length, reinterpret_cast<void*>(&view_length)},
+                    {Py_mp_subscript, reinterpret_cast<void*>(&array_view_subscript)},
+                    {Py_sq_length, reinterpret_cast<void*>(&view_length)},
+                    {Py_sq_item, reinterpret_cast<void*>(&array_view_item)},
+                    {Py_sq_contains, reinterpret_cast<void*>(&array_view_contains)},
+                    {0, nullptr}
+                };
+
+                py::object object_type = py::reinterpret_steal<py::object>(reinterpret_cast<PyObject*>(
+                    make_view_type("pybind11_json.JsonObjectView", object_slots, "Mapping")));
+                py::object array_type = py::reinterpret_steal<py::object>(reinterpret_cast<PyObject*>(
+                    make_view_type("pybind11_json.JsonArrayView", array_slots, "Sequence")));
+                // Leaked on purpose, like the types themselves
+                types = py::set_shared_data(id, new view_types{
+                    reinterpret_cast<PyTypeObject*>(object_type.release().ptr()),
+                    reinterpret_cast<PyTypeObject*>(array_type.release().ptr())});
+            }
+            return *static_cast<view_types*>(types);
+        }
+
+        inline py::object make_view(const view_root& root, const nl::json& node)
+        {
+            if (!node.is_structured())
+            {
+                return detail::from_json(node, nullptr, from_json_options());
+            }
+
+            view_types types = get_view_types();
+            PyTypeObject* type = node.is_object() ? types.object : types.array;
+            py::dict children;
+            PyObject* self = type->tp_alloc(type, 0);
+            if (self == nullptr)
+            {
+                throw py::error_already_set();
+            }
+            view_object* view = reinterpret_cast<view_object*>(self);
+            new (&view->root) view_root(root);
+            view->node = &node;
+            view->children = children.release().ptr();
+            return py::reinterpret_steal<py::object>(self);
+        }
+    }
+
+    /*
+     * Wraps `view` in a lazy Python view. Scalars are converted at once.
+     */
+    inline py::object make_view(const json_view& view)
+    {
+        return detail::make_view(view.root(), view.json());
+    }
+
+    namespace detail
+    {
+        inline const char* base64_alphabet()
+        {
+            return "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        }
+
+        inline char* base64_encode_scalar(const unsigned char* in, std::size_t size, char* out)
+        {
+            const char* alphabet = base64_alphabet();
+            std::size_t i = 0;
+            for (; i + 3 <= size; i += 3)
+            {
+                std::uint32_t block = (std::uint32_t(in[i]) << 16) | (std::uint32_t(in[i + 1]) << 8) | std::uint32_t(in[i + 2]);
+                *out++ = alphabet[(block >> 18) & 0x3F];
+                *out++ = alphabet[(block >> 12) & 0x3F];
+                *out++ = alphabet[(block >> 6) & 0x3F];
+                *out++ = alphabet[block & 0x3F];
+            }
+            if (i < size)
+            {
+                std::uint32_t block = std::uint32_t(in[i]) << 16;
+                if (i + 1 < size)
+                {
+                    block |= std::uint32_t(in[i + 1]) << 8;
+                }
+                *out++ = alphabet[(block >> 18) & 0x3F];
+                *out++ = alphabet[(block >> 12) & 0x3F];
+                *out++ = i + 1 < size ? alphabet[(block >> 6) & 0x3F] : '=';
+                *out++ = '=';
+            }
+            return out;
+        }
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+        // SIMD encoding from W. Mula and D. Lemire, "Faster Base64 Encoding
+        // and Decoding Using AVX2 Instructions": each 32 bit lane receives 3
+        // input bytes, which are split into four 6 bit values and mapped to
+        // ASCII with a small lookup table.
+        inline __m128i base64_reshuffle(__m128i in)
+        {
+            in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+            const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+            const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+            const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+            const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+            return _mm_or_si128(t1, t3);
+        }
+
+        inline __m128i base64_translate(__m128i in)
+        {
+            const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+            __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+            indices = _mm_sub_epi8(indices, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+            return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+        }
+#endif
+
+#if defined(__AVX2__)
+        inline __m256i base64_reshuffle(__m256i in)
+        {
+            in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                         10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+            const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+            const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+            const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            return _mm256_or_si256(t1, t3);
+        }
+
+        inline __m256i base64_translate(__m256i in)
+        {
+            const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                                 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+            __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+            indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+            return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+        }
+#endif
+
+        struct base64_decode_table
+        {
+            base64_decode_table()
+            {
+                std::fill(values, values + 256, static_cast<signed char>(-1));
+                const char* alphabet = base64_alphabet();
+                for (int i = 0; i < 64; ++i)
+                {
+                    values[static_cast<unsigned char>(alphabet[i])] = static_cast<signed char>(i);
+                }
+            }
+
+            signed char values[256];
+        };
+    }
+
+    /*
+     * Appends the standard (RFC 4648, padded) base64 encoding of the input
+     * to `out`. Uses AVX2 or SSSE3 when the compiler targets them.
+     */
+    inline void base64_encode(const char* data, std::size_t size, std::string& out)
+    {
+        std::size_t offset = out.size();
+        out.resize(offset + 4 * ((size + 2) / 3));
+
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+        char* dst = &out[0] + offset;
+#if defined(__AVX2__)
+        // Each iteration reads 28 bytes and encodes the first 24 of them
+        for (; size >= 28; in += 24, dst += 32, size -= 24)
+        {
+            __m256i block = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)), 1);
+            block = detail::base64_translate(detail::base64_reshuffle(block));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), block);
+        }
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+        // Each iteration reads 16 bytes and encodes the first 12 of them
+        for (; size >= 16; in += 12, dst += 16, size -= 12)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            block = detail::base64_translate(detail::base64_reshuffle(block));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), block);
+        }
+#endif
+        detail::base64_encode_scalar(in, size, dst);
+    }
+
+    inline std::string base64_encode(const char* data, std::size_t size)
+    {
+        std::string out;
+        base64_encode(data, size, out);
+        return out;
+    }
+
+    /*
+     * Decodes standard padded base64, throwing std::runtime_error on
+     * malformed input.
+     */
+    inline std::string base64_decode(const char* data, std::size_t size)
+    {
+        static const detail::base64_decode_table table;
+
+        if (size % 4 != 0)
+        {
+            throw std::runtime_error("base64_decode received an input whose length is not a multiple of 4");
+        }
+
+        std::size_t padding = 0;
+        if (size != 0 && data[size - 1] == '=')
+        {
+            padding = data[size - 2] == '=' ? 2 : 1;
+        }
+
+        std::string out;
+        out.resize(size / 4 * 3 - padding);
+        char* dst = &out[0];
+        for (std::size_t i = 0; i < size; i += 4)
+        {
+            bool last = i + 4 == size;
+            std::uint32_t block = 0;
+            for (std::size_t k = 0; k < 4; ++k)
+            {
+                unsigned char c = static_cast<unsigned char>(data[i + k]);
+                signed char value = table.values[c];
+                if (value < 0)
+                {
+                    if (!(last && c == '=' && k >= 4 - padding))
+                    {
+                        throw std::runtime_error("base64_decode received invalid base64 data");
+                    }
+                    value = 0;
+                }
+                block = (block << 6) | static_cast<std::uint32_t>(value);
+            }
+
+            std::size_t count = last ? 3 - padding : 3;
+            *dst++ = static_cast<char>((block >> 16) & 0xFF);
+            if (count > 1)
+            {
+                *dst++ = static_cast<char>((block >> 8) & 0xFF);
+            }
+            if (count > 2)
+            {
+                *dst++ = static_cast<char>(block & 0xFF);
+            }
+        }
+        return out;
+    }
+
+    inline std::string base64_decode(const std::string& text)
+    {
+        return base64_decode(text.data(), text.size());
+    }
+
+    // How to_json converts bytes objects
+    enum class bytes_mode
+    {
+        base64, // a base64 encoded string
+        binary  // an nl::json binary value (nlohmann_json >= 3.8), carried
+                // as raw bytes by CBOR, MessagePack, BSON and UBJSON
+    };
+
+    // How to_json handles Python ints that fit in neither
+    // nl::json::number_integer_t nor nl::json::number_unsigned_t
+    enum class int_overflow
+    {
+        error,  // throw std::runtime_error
+        string, // serialize the decimal representation as a string
+        float_  // serialize the nearest double
+    };
+
+    // How to_json guards against self-referencing containers
+    enum class cycle_check
+    {
+        full,  // track the ancestors of each container and detect cycles
+        depth, // only limit the nesting depth to options::max_depth
+        none   // no check at all, for trusted and acyclic input
+    };
+
+    // How to_json handles dict keys that are not str instances
+    enum class key_policy
+    {
+        stringify, // use str(key)
+        skip,      // leave the entry out
+        error      // throw std::runtime_error
+    };
+
+    // Which objects to_json converts once when they occur several times
+    enum class memo_policy
+    {
+        none,      // convert every occurrence
+        immutable, // repeated tuples
+        all        // repeated tuples, lists and dicts, which must then not
+                   // change during the conversion
+    };
+
+    struct options
+    {
+        int_overflow on_int_overflow = int_overflow::error;
+        key_policy non_str_keys = key_policy::stringify;
+        cycle_check cycles = cycle_check::full;
+        std::size_t max_depth = 1000;
+        bytes_mode bytes = bytes_mode::base64;
+        // Free-threaded CPython only: threads converting the items of a
+        // top-level list or tuple of at least parallel_min_size items (0: one
+        // per core). Ignored by dump, and on builds with a GIL unless
+        // PYBIND11_JSON_PARALLEL is defined. Each list and dict is read under
+        // its lock, so other threads may modify them meanwhile: a container
+        // changed during the conversion is written as it was when reached.
+        std::size_t threads = 1;
+        std::size_t parallel_min_size = 16384;
+        memo_policy memoize = memo_policy::none;
+    };
+
+    struct dump_options : options
+    {
+        // Same meaning as the arguments of nl::json::dump
+        int indent = -1;
+        char indent_char = ' ';
+        bool ensure_ascii = false;
+        // Emit object keys in nl::json (std::map) order, which is also the
+        // order of to_json(obj).dump()
+        bool sort_keys = true;
+        // Significant digits of floats, up to 17. 0 writes the shortest
+        // digits which read back as the same double.
+        int float_precision = 0;
+    };
+
+    // Converts an object to one which to_json knows how to convert
+    using converter = std::function<py::object(const py::handle&)>;
+
+    namespace detail
+    {
+        using converter_map = std::unordered_map<PyTypeObject*, std::pair<py::object, converter>>;
+
+        /*
+         * The registry is copied on write: a conversion works on the
+         * snapshot taken when it starts, which no other thread modifies.
+         * Leaked on purpose: the registered types must not be released
+         * after the interpreter is finalized.
+         */
+        struct converter_registry
+        {
+            std::mutex mutex;
+            std::shared_ptr<const converter_map> current = std::make_shared<converter_map>();
+        };
+
+        inline converter_registry& registry()
+        {
+            static auto* instance = new converter_registry();
+            return *instance;
+        }
+
+        inline std::shared_ptr<const converter_map> converters()
+        {
+            converter_registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            return r.current;
+        }
+
+        // Applies `update` to a copy of the registry and publishes it. The
+        // previous snapshot is released after the lock.
+        template <class Update>
+        inline void update_converters(Update&& update)
+        {
+            converter_registry& r = registry();
+            std::shared_ptr<const converter_map> previous;
+            {
+                std::lock_guard<std::mutex> lock(r.mutex);
+                std::shared_ptr<converter_map> next = std::make_shared<converter_map>(*r.current);
+                update(*next);
+                previous = std::move(r.current);
+                r.current = std::move(next);
+            }
+        }
+    }
+
+    /*
+     * Registers how to_json and dump convert instances of `type` and of its
+     * subclasses, e.g. datetime to an ISO 8601 str. Exact built-in JSON
+     * types (str, int, float, list, ...) are not affected. The registry is
+     * global and may be updated from any thread with the GIL held;
+     * conversions already running keep the converters they started with.
+     * Clear it before finalizing the interpreter.
+     */
+    inline void register_converter(const py::handle& type, converter fn)
+    {
+        if (!PyType_Check(type.ptr()))
+        {
+            throw std::runtime_error("register_converter expects a type: " + py::repr(type).cast<std::string>());
+        }
+        auto entry = std::make_pair(py::reinterpret_borrow<py::object>(type), std::move(fn));
+        detail::update_converters([&](detail::converter_map& map)
+        {
+            map[reinterpret_cast<PyTypeObject*>(type.ptr())] = std::move(entry);
+        });
+    }
+
+    inline void unregister_converter(const py::handle& type)
+    {
+        detail::update_converters([&](detail::converter_map& map)
+        {
+            map.erase(reinterpret_cast<PyTypeObject*>(type.ptr()));
+        });
+    }
+
+    inline void clear_converters()
+    {
+        detail::update_converters([](detail::converter_map& map)
+        {
+            map.clear();
+        });
+    }
+
+    namespace detail
+    {
+        enum class type_kind
+        {
+            boolean,
+            integer,
+            floating,
+            bytes,
+            string,
+            sequence,
+            dict,
+            buffer,
+            view,
+            converter,
+            unsupported
+        };
+
+        struct dispatch
+        {
+            type_kind kind;
+            const converter* convert;
+        };
+
+        // The first class of the MRO which is either registered or a
+        // built-in JSON type decides, so that e.g. an IntEnum is an int.
+        inline dispatch resolve(PyTypeObject* type, const converter_map& registry)
+        {
+            PyObject* mro = type->tp_mro;
+            const Py_ssize_t size = mro != nullptr ? PyTuple_GET_SIZE(mro) : 0;
+            for (Py_ssize_t i = 0; i < size; ++i)
+            {
+                PyTypeObject* base = reinterpret_cast<PyTypeObject*>(PyTuple_GET_ITEM(mro, i));
+                auto it = registry.find(base);
+                if (it != registry.end())
+                {
+                    return {type_kind::converter, &it->second.second};
+                }
+                if (base == &PyBool_Type)
+                {
+                    return {type_kind::boolean, nullptr};
+                }
+                if (base == &PyLong_Type)
+                {
+                    return {type_kind::integer, nullptr};
+                }
+                if (base == &PyFloat_Type)
+                {
+                    return {type_kind::floating, nullptr};
+                }
+                if (base == &PyBytes_Type)
+                {
+                    return {type_kind::bytes, nullptr};
+                }
+                if (base == &PyUnicode_Type)
+                {
+                    return {type_kind::string, nullptr};
+                }
+                if (base == &PyList_Type || base == &PyTuple_Type)
+                {
+                    return {type_kind::sequence, nullptr};
+                }
+                if (base == &PyDict_Type)
+                {
+                    return {type_kind::dict, nullptr};
+                }
+            }
+            if (type->tp_as_buffer != nullptr && type->tp_as_buffer->bf_getbuffer != nullptr)
+            {
+                return {type_kind::buffer, nullptr};
+            }
+            if (type->tp_dealloc == &view_dealloc)
+            {
+                return {type_kind::view, nullptr};
+            }
+            return {type_kind::unsupported, nullptr};
+        }
+
+        template <class BasicJsonType>
+        class json_builder;
+
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+        using memo_json = nl::ordered_json;
+#else
+        // Keys are then sorted: only sorted outputs are memoized
+        using memo_json = nl::json;
+#endif
+
+        /*
+         * Containers met during one conversion, by address. The first
+         * occurrence is walked as usual; the second one is converted into
+         * `json`, which is replayed from then on. Entries keep their object
+         * alive so that an address cannot be reused by another object.
+         */
+        template <class Json>
+        struct memo_entry
+        {
+            py::object object;
+            std::unique_ptr<Json> json;
+            bool building = false;
+        };
+
+        template <class Json>
+        using memo_table = std::unordered_map<const PyObject*, memo_entry<Json>>;
+
+        // Memoized containers are copied into the trees built by to_json, and
+        // replayed as events from a memo_json by the other handlers.
+        template <class Handler>
+        struct memo_traits
+        {
+            using type = memo_json;
+            static constexpr bool copy = false;
+        };
+
+        template <class BasicJsonType>
+        struct memo_traits<json_builder<BasicJsonType>>
+        {
+            using type = BasicJsonType;
+            static constexpr bool copy = true;
+        };
+
+        // Whether to_json may convert `obj`, judging by its type only
+        inline bool is_convertible(const py::handle& obj)
+        {
+            return obj.ptr() == nullptr || obj.ptr() == Py_None || resolve(Py_TYPE(obj.ptr()), *converters()).kind != type_kind::unsupported;
+        }
+
+        /*
+         * The items of a list as a tuple. On free-threaded builds the copy
+         * is made in a critical section on the list, so that another thread
+         * appending to it or removing from it cannot tear the copy.
+         */
+        inline py::tuple list_snapshot(const py::handle& list)
+        {
+            PyObject* items = nullptr;
+#ifdef Py_GIL_DISABLED
+            Py_BEGIN_CRITICAL_SECTION(list.ptr());
+#endif
+            items = PyList_AsTuple(list.ptr());
+#ifdef Py_GIL_DISABLED
+            Py_END_CRITICAL_SECTION();
+#endif
+            if (items == nullptr)
+            {
+                throw py::error_already_set();
+            }
+            return py::reinterpret_steal<py::tuple>(items);
+        }
+
+        /*
+         * Emits the events of a JSON tree to a py_walker handler, e.g. to
+         * write it like the Python objects it was built from. Binary values
+         * are passed to `binary`, which decides how they are written.
+         */
+        template <class Json, class Handler, class Binary>
+        inline void walk_json(const Json& j, Handler& handler, Binary&& binary)
+        {
+            switch (j.type())
+            {
+                case Json::value_t::boolean:
+                    handler.boolean(j.template get<bool>());
+                    return;
+                case Json::value_t::number_integer:
+                    handler.number_integer(j.template get<typename Json::number_integer_t>());
+                    return;
+                case Json::value_t::number_unsigned:
+                    handler.number_unsigned(j.template get<typename Json::number_unsigned_t>());
+                    return;
+                case Json::value_t::number_float:
+                    handler.number_float(j.template get<double>());
+                    return;
+                case Json::value_t::string:
+                {
+                    const typename Json::string_t& val = j.template get_ref<const typename Json::string_t&>();
+                    handler.string(val.data(), val.size());
+                    return;
+                }
+#ifdef PYBIND11_JSON_HAS_BINARY
+                case Json::value_t::binary:
+                {
+                    const typename Json::binary_t& val = j.get_binary();
+                    binary(reinterpret_cast<const char*>(val.data()), val.size());
+                    return;
+                }
+#endif
+                case Json::value_t::array:
+                    handler.start_array(j.size());
+                    for (const Json& item : j)
+                    {
+                        walk_json(item, handler, binary);
+                    }
+                    handler.end_array();
+                    return;
+                case Json::value_t::object:
+                    handler.start_object(j.size());
+                    for (auto it = j.begin(); it != j.end(); ++it)
+                    {
+                        handler.key(it.key().data(), it.key().size());
+                        walk_json(it.value(), handler, binary);
+                    }
+                    handler.end_object();
+                    return;
+                default:
+                    handler.null();
+                    return;
+            }
+        }
+
+        /*
+         * Walks a Python object graph and reports it to a handler as a
+         * sequence of events (null, boolean, number_*, string, start/end of
+         * arrays and objects, keys). to_json builds an nl::json tree from
+         * those events while dump writes them straight as JSON text.
+         */
+        template <class Handler>
+        class py_walker
+        {
+        public:
+            py_walker(Handler& handler, const options& opts, bool sort_keys = false)
+                : m_handler(handler), m_options(opts), m_sort_keys(sort_keys)
+            {
+            }
+
+            // Conversion errors then stop the walk and are stored in `error`
+            // instead of being thrown. Python errors are still thrown.
+            void report_errors(std::string& error)
+            {
+                m_error = &error;
+            }
+
+            bool failed() const
+            {
+                return m_failed;
+            }
+
+            // Containers treated as already being visited
+            template <class Iterator>
+            void add_ancestors(Iterator first, Iterator last)
+            {
+                m_ancestors.insert(m_ancestors.end(), first, last);
+                m_depth += static_cast<std::size_t>(std::distance(first, last));
+            }
+
+            void walk(const py::handle& obj)
+            {
+                if (obj.ptr() == nullptr || obj.ptr() == Py_None)
+                {
+                    m_handler.null();
+                    return;
+                }
+
+                const dispatch& target = lookup(Py_TYPE(obj.ptr()));
+                switch (target.kind)
+                {
+                    case type_kind::boolean:
+                        m_handler.boolean(obj.ptr() == Py_True);
+                        return;
+                    case type_kind::integer:
+                        walk_int(obj);
+                        return;
+                    case type_kind::floating:
+                        m_handler.number_float(PyFloat_AS_DOUBLE(obj.ptr()));
+                        return;
+                    case type_kind::bytes:
+                        walk_bytes(obj);
+                        return;
+                    case type_kind::string:
+                        walk_str(obj);
+                        return;
+                    case type_kind::sequence:
+                    {
+                        if (replay(obj, PyTuple_Check(obj.ptr())))
+                        {
+                            return;
+                        }
+                        if (!enter(obj))
+                        {
+                            return;
+                        }
+
+#ifdef Py_GIL_DISABLED
+                        // Another thread may resize a list meanwhile, and
+                        // the size given to start_array must stay exact
+                        const py::object items = PyList_Check(obj.ptr()) ? list_snapshot(obj) : py::reinterpret_borrow<py::object>(obj);
+#else
+                        const py::handle items = obj;
+#endif
+                        m_handler.start_array(static_cast<std::size_t>(PySequence_Fast_GET_SIZE(items.ptr())));
+                        for (const py::handle value : items)
+                        {
+                            walk(value);
+                            if (m_failed)
+                            {
+                                return;
+                            }
+                        }
+                        m_handler.end_array();
+
+                        leave();
+                        return;
+                    }
+                    case type_kind::dict:
+                    {
+                        if (replay(obj, false))
+                        {
+                            return;
+                        }
+                        if (!enter(obj))
+                        {
+                            return;
+                        }
+
+                        if (m_sort_keys)
+                        {
+                            walk_sorted_items(obj);
+                        }
+                        else
+                        {
+                            walk_items(obj);
+                        }
+                        if (m_failed)
+                        {
+                            return;
+                        }
+                        m_handler.end_object();
+
+                        leave();
+                        return;
+                    }
+                    case type_kind::buffer:
+                        walk_buffer(obj);
+                        return;
+                    case type_kind::view:
+                        walk_json(view_node(obj.ptr()));
+                        return;
+                    case type_kind::converter:
+                    {
+                        py::object converted = (*target.convert)(obj);
+                        // Walking it again would recurse until the stack
+                        // overflows when cycles are not checked
+                        if (converted.is(obj))
+                        {
+                            fail("to_json converter returned its argument: " + describe(obj));
+                            return;
+                        }
+                        if (!enter(obj))
+                        {
+                            return;
+                        }
+                        walk(converted);
+                        if (m_failed)
+                        {
+                            return;
+                        }
+                        leave();
+                        return;
+                    }
+                    case type_kind::unsupported:
+                        break;
+                }
+
+                fail("to_json not implemented for this type of object: " + describe(obj));
+            }
+
+        private:
+
+            template <class>
+            friend class py_walker;
+
+            using memo_value = typename memo_traits<Handler>::type;
+
+            // Emits a memoized container, converting it on its second
+            // occurrence. Returns false when it must be walked as usual.
+            bool replay(const py::handle& obj, bool immutable)
+            {
+                if (m_options.memoize == memo_policy::none || (!immutable && m_options.memoize != memo_policy::all))
+                {
+                    return false;
+                }
+#ifndef PYBIND11_JSON_HAS_ORDERED_JSON
+                if (!memo_traits<Handler>::copy && !m_sort_keys)
+                {
+                    return false;
+                }
+#endif
+                if (m_memo == nullptr)
+                {
+                    m_own_memo.reset(new memo_table<memo_value>());
+                    m_memo = m_own_memo.get();
+                }
+
+                memo_entry<memo_value>& entry = (*m_memo)[obj.ptr()];
+                if (!entry.object)
+                {
+                    entry.object = py::reinterpret_borrow<py::object>(obj);
+                    return false;
+                }
+                if (entry.building)
+                {
+                    return false;
+                }
+                if (!entry.json)
+                {
+                    std::unique_ptr<memo_value> json(new memo_value());
+                    json_builder<memo_value> builder(*json);
+                    py_walker<json_builder<memo_value>> walker(builder, m_options, m_sort_keys);
+                    walker.m_memo = m_memo;
+                    walker.m_ancestors = m_ancestors;
+                    walker.m_depth = m_depth;
+                    if (m_error != nullptr)
+                    {
+                        walker.report_errors(*m_error);
+                    }
+
+                    entry.building = true;
+                    try
+                    {
+                        walker.walk(obj);
+                    }
+                    catch (...)
+                    {
+                        entry.building = false;
+                        throw;
+                    }
+                    entry.building = false;
+                    if (walker.failed())
+                    {
+                        m_failed = true;
+                        return true;
+                    }
+                    entry.json = std::move(json);
+                }
+                replay(*entry.json, std::integral_constant<bool, memo_traits<Handler>::copy>());
+                return true;
+            }
+
+            void replay(const memo_value& j, std::true_type)
+            {
+                m_handler.value(j);
+            }
+
+            void replay(const memo_value& j, std::false_type)
+            {
+                walk_json(j);
+            }
+
+            // What a failure message shows of `obj`: its repr when throwing,
+            // only its type name otherwise, since repr may run Python code
+            std::string describe(const py::handle& obj) const
+            {
+                if (m_error == nullptr)
+                {
+                    return py::repr(obj).cast<std::string>();
+                }
+                return Py_TYPE(obj.ptr())->tp_name;
+            }
+
+            void fail(std::string message)
+            {
+                if (m_error == nullptr)
+                {
+                    throw std::runtime_error(message);
+                }
+                *m_error = std::move(message);
+                m_failed = true;
+            }
+
+            // Only the path from the root matters to detect cycles, so the
+            // ancestors are kept in a plain stack rather than a set.
+            bool enter(const py::handle& obj)
+            {
+                switch (m_options.cycles)
+                {
+                    case cycle_check::full:
+                    {
+                        if (std::find(m_ancestors.begin(), m_ancestors.end(), obj.ptr()) != m_ancestors.end()) {
+                            fail("Circular reference detected");
+                            return false;
+                        }
+                        m_ancestors.push_back(obj.ptr());
+                        break;
+                    }
+                    case cycle_check::depth:
+                    {
+                        if (m_depth >= m_options.max_depth) {
+                            fail("Maximum nesting depth exceeded, possibly a circular reference");
+                            return false;
+                        }
+                        break;
+                    }
+                    case cycle_check::none:
+                        break;
+                }
+                ++m_depth;
+                return true;
+            }
+
+            void leave()
+            {
+                if (m_options.cycles == cycle_check::full)
+                {
+                    m_ancestors.pop_back();
+                }
+                --m_depth;
+            }
+
+            void walk_int(const py::handle& obj)
+            {
+                int overflow = 0;
+                long long s = PyLong_AsLongLongAndOverflow(obj.ptr(), &overflow);
+                if (overflow == 0)
+                {
+                    if (s == -1 && PyErr_Occurred())
+                    {
+                        throw py::error_already_set();
+                    }
+                    m_handler.number_integer(static_cast<nl::json::number_integer_t>(s));
+                    return;
+                }
+                if (overflow > 0)
+                {
+                    unsigned long long u = PyLong_AsUnsignedLongLong(obj.ptr());
+                    if (u != static_cast<unsigned long long>(-1) || !PyErr_Occurred())
+                    {
+                        m_handler.number_unsigned(static_cast<nl::json::number_unsigned_t>(u));
+                        return;
+                    }
+                    PyErr_Clear();
+                }
+
+                switch (m_options.on_int_overflow)
+                {
+                    case int_overflow::string:
+                    {
+                        py::str decimal = py::reinterpret_steal<py::str>(PyNumber_ToBase(obj.ptr(), 10));
+                        if (!decimal)
+                        {
+                            throw py::error_already_set();
+                        }
+                        walk_str(decimal);
+                        return;
+                    }
+                    case int_overflow::float_:
+                    {
+                        double d = PyLong_AsDouble(obj.ptr());
+                        if (d == -1.0 && PyErr_Occurred())
+                        {
+                            PyErr_Clear();
+                            break;
+                        }
+                        m_handler.number_float(d);
+                        return;
+                    }
+                    case int_overflow::error:
+                        break;
+                }
+                fail("to_json received an integer out of range for both nl::json::number_integer_t and nl::json::number_unsigned_t type: " + describe(obj));
+            }
+
+            void walk_bytes(const py::handle& obj)
+            {
+                walk_bytes(PyBytes_AS_STRING(obj.ptr()), static_cast<std::size_t>(PyBytes_GET_SIZE(obj.ptr())));
+            }
+
+            void walk_bytes(const char* data, std::size_t size)
+            {
+                if (m_options.bytes == bytes_mode::binary)
+                {
+#ifdef PYBIND11_JSON_HAS_BINARY
+                    m_handler.binary(data, size);
+                    return;
+#else
+                    fail("to_json cannot produce binary values with nlohmann_json < 3.8");
+                    return;
+#endif
+                }
+                m_scratch.clear();
+                base64_encode(data, size, m_scratch);
+#ifdef PYBIND11_JSON_STATS
+                m_handler.base64(size);
+#endif
+                m_handler.string(m_scratch.data(), m_scratch.size());
+            }
+
+            // Lazy views and memoized containers, without going through
+            // Python objects; binary values follow options::bytes
+            template <class Json>
+            void walk_json(const Json& j)
+            {
+                detail::walk_json(j, m_handler, [this](const char* data, std::size_t size) { walk_bytes(data, size); });
+            }
+
+            // Buffers of numbers (NumPy arrays, array.array, memoryview...)
+            // become arrays, nested for each dimension, read in a typed loop
+            // without creating a Python object per item.
+            void walk_buffer(const py::handle& obj)
+            {
+                buffer_view buffer(obj.ptr(), PyBUF_RECORDS_RO);
+                const Py_buffer& view = buffer.get();
+                const char kind = buffer_kind(view);
+                if (kind == 0)
+                {
+                    fail("to_json not implemented for buffers of format '" + std::string(view.format != nullptr ? view.format : "B") + "': " + describe(obj));
+                    return;
+                }
+                walk_buffer_dim(view, kind, 0, static_cast<const char*>(view.buf));
+            }
+
+            void walk_buffer_dim(const Py_buffer& view, char kind, int dim, const char* data)
+            {
+                if (dim == view.ndim)
+                {
+                    walk_buffer_items(view, kind, data, 1, 0);
+                    return;
+                }
+
+                const Py_ssize_t size = view.shape[dim];
+                const Py_ssize_t stride = view.strides[dim];
+                m_handler.start_array(static_cast<std::size_t>(size));
+                if (dim + 1 == view.ndim)
+                {
+                    walk_buffer_items(view, kind, data, size, stride);
+                }
+                else
+                {
+                    for (Py_ssize_t i = 0; i < size; ++i)
+                    {
+                        walk_buffer_dim(view, kind, dim + 1, data + i * stride);
+                    }
+                }
+                m_handler.end_array();
+            }
+
+            void walk_buffer_items(const Py_buffer& view, char kind, const char* data, Py_ssize_t size, Py_ssize_t stride)
+            {
+                switch (kind)
+                {
+                    case 'i':
+                        switch (view.itemsize)
+                        {
+                            case 1: return walk_numbers<std::int8_t>(data, size, stride);
+                            case 2: return walk_numbers<std::int16_t>(data, size, stride);
+                            case 4: return walk_numbers<std::int32_t>(data, size, stride);
+                            default: return walk_numbers<std::int64_t>(data, size, stride);
+                        }
+                    case 'u':
+                        switch (view.itemsize)
+                        {
+                            case 1: return walk_numbers<std::uint8_t>(data, size, stride);
+                            case 2: return walk_numbers<std::uint16_t>(data, size, stride);
+                            case 4: return walk_numbers<std::uint32_t>(data, size, stride);
+                            default: return walk_numbers<std::uint64_t>(data, size, stride);
+                        }
+                    case 'f':
+                        if (view.itemsize == 4)
+                        {
+                            return walk_numbers<float>(data, size, stride);
+                        }
+                        return walk_numbers<double>(data, size, stride);
+                    default:
+                        return walk_numbers<bool>(data, size, stride);
+                }
+            }
+
+            template <class T>
+            void walk_numbers(const char* data, Py_ssize_t size, Py_ssize_t stride)
+            {
+                for (Py_ssize_t i = 0; i < size; ++i, data += stride)
+                {
+                    T val;
+                    std::memcpy(&val, data, sizeof(T));
+                    number(val);
+                }
+            }
+
+            // Same JSON types as for the equivalent Python objects
+            template <class T>
+            typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type number(T val)
+            {
+                m_handler.number_integer(static_cast<nl::json::number_integer_t>(val));
+            }
+
+            template <class T>
+            typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value>::type number(T val)
+            {
+                if (val <= static_cast<std::uint64_t>((std::numeric_limits<std::int64_t>::max)()))
+                {
+                    m_handler.number_integer(static_cast<nl::json::number_integer_t>(val));
+                }
+                else
+                {
+                    m_handler.number_unsigned(static_cast<nl::json::number_unsigned_t>(val));
+                }
+            }
+
+            template <class T>
+            typename std::enable_if<std::is_floating_point<T>::value>::type number(T val)
+            {
+                m_handler.number_float(static_cast<double>(val));
+            }
+
+            void number(bool val)
+            {
+                m_handler.boolean(val);
+            }
+
+            void walk_str(const py::handle& obj)
+            {
+                Py_ssize_t size = 0;
+                const char* data = PyUnicode_AsUTF8AndSize(obj.ptr(), &size);
+                if (data == nullptr)
+                {
+                    throw py::error_already_set();
+                }
+                m_handler.string(data, static_cast<std::size_t>(size));
+            }
+
+            // Reads a dict key as UTF-8. Exact str keys expose their cached
+            // UTF-8 buffer directly; other keys go through the key policy and
+            // `holder` keeps their string alive. Returns false for skipped keys.
+            bool key_utf8(PyObject* key, py::object& holder, const char*& data, std::size_t& size)
+            {
+                if (!PyUnicode_CheckExact(key))
+                {
+                    if (m_options.non_str_keys == key_policy::stringify)
+                    {
+                        holder = py::str(py::handle(key));
+                        key = holder.ptr();
+                    }
+                    else if (!PyUnicode_Check(key))
+                    {
+                        if (m_options.non_str_keys == key_policy::skip)
+                        {
+                            return false;
+                        }
+                        fail("to_json received a dict key which is not a string: " + describe(key));
+                        return false;
+                    }
+                }
+
+                Py_ssize_t length = 0;
+                data = PyUnicode_AsUTF8AndSize(key, &length);
+                if (data == nullptr)
+                {
+                    throw py::error_already_set();
+                }
+                size = static_cast<std::size_t>(length);
+                return true;
+            }
+
+            using dict_entries = std::vector<std::pair<py::object, py::object>>;
+
+            // Strong references to the items of a dict, taken before any of
+            // them is converted: a converter, __index__ or __float__ may
+            // modify the dict and would otherwise free a borrowed key or value
+            static dict_entries dict_items(const py::handle& obj)
+            {
+                dict_entries entries;
+                entries.reserve(static_cast<std::size_t>(PyDict_Size(obj.ptr())));
+                PyObject* key = nullptr;
+                PyObject* value = nullptr;
+                Py_ssize_t pos = 0;
+#ifdef Py_GIL_DISABLED
+                // PyDict_Next is only safe with the dict locked when other
+                // threads may modify it
+                Py_BEGIN_CRITICAL_SECTION(obj.ptr());
+#endif
+                while (PyDict_Next(obj.ptr(), &pos, &key, &value))
+                {
+                    entries.emplace_back(py::reinterpret_borrow<py::object>(key), py::reinterpret_borrow<py::object>(value));
+                }
+#ifdef Py_GIL_DISABLED
+                Py_END_CRITICAL_SECTION();
+#endif
+                return entries;
+            }
+
+            void walk_items(const py::handle& obj)
+            {
+                const dict_entries entries = dict_items(obj);
+                m_handler.start_object(entries.size());
+                for (const auto& entry : entries)
+                {
+                    py::object holder;
+                    const char* data = nullptr;
+                    std::size_t size = 0;
+                    if (key_utf8(entry.first.ptr(), holder, data, size))
+                    {
+                        m_handler.key(data, size);
+                        walk(entry.second);
+                    }
+                    if (m_failed)
+                    {
+                        return;
+                    }
+                }
+            }
+
+            struct dict_item
+            {
+                const char* data;
+                std::size_t size;
+                // `data` points into the key, or into `holder` for a
+                // stringified key
+                py::object key;
+                py::object holder;
+                py::object value;
+            };
+
+            // nl::json keeps its keys in a std::map: emit them in that order
+            // and let the last one win when two keys stringify identically.
+            // The size given to start_object is then exact, which binary
+            // formats rely on.
+            void walk_sorted_items(const py::handle& obj)
+            {
+                dict_entries entries = dict_items(obj);
+                std::vector<dict_item> items;
+                items.reserve(entries.size());
+                for (auto& entry : entries)
+                {
+                    dict_item item;
+                    if (key_utf8(entry.first.ptr(), item.holder, item.data, item.size))
+                    {
+                        item.key = std::move(entry.first);
+                        item.value = std::move(entry.second);
+                        items.push_back(std::move(item));
+                    }
+                    if (m_failed)
+                    {
+                        return;
+                    }
+                }
+
+                auto less = [](const dict_item& lhs, const dict_item& rhs)
+                {
+                    int cmp = std::memcmp(lhs.data, rhs.data, std::min(lhs.size, rhs.size));
+                    return cmp < 0 || (cmp == 0 && lhs.size < rhs.size);
+                };
+                std::stable_sort(items.begin(), items.end(), less);
+
+                std::size_t count = 0;
+                for (std::size_t i = 0; i < items.size(); ++i)
+                {
+                    if (i + 1 < items.size() && !less(items[i], items[i + 1]))
+                    {
+                        continue;
+                    }
+                    if (count != i)
+                    {
+                        items[count] = std::move(items[i]);
+                    }
+                    ++count;
+                }
+                items.resize(count);
+
+                m_handler.start_object(count);
+                for (const dict_item& item : items)
+                {
+                    m_handler.key(item.data, item.size);
+                    walk(item.value);
+                    if (m_failed)
+                    {
+                        return;
+                    }
+                }
+            }
+
+            // The exact built-in types resolve with a pointer compare, other
+            // types through a cache filled on their first occurrence.
+            const dispatch& lookup(PyTypeObject* type)
+            {
+                static const dispatch string_dispatch = {type_kind::string, nullptr};
+                static const dispatch integer_dispatch = {type_kind::integer, nullptr};
+                static const dispatch floating_dispatch = {type_kind::floating, nullptr};
+                static const dispatch dict_dispatch = {type_kind::dict, nullptr};
+                static const dispatch sequence_dispatch = {type_kind::sequence, nullptr};
+                static const dispatch boolean_dispatch = {type_kind::boolean, nullptr};
+                if (type == &PyUnicode_Type)
+                {
+                    return string_dispatch;
+                }
+                if (type == &PyLong_Type)
+                {
+                    return integer_dispatch;
+                }
+                if (type == &PyFloat_Type)
+                {
+                    return floating_dispatch;
+                }
+                if (type == &PyDict_Type)
+                {
+                    return dict_dispatch;
+                }
+                if (type == &PyList_Type || type == &PyTuple_Type)
+                {
+                    return sequence_dispatch;
+                }
+                if (type == &PyBool_Type)
+                {
+                    return boolean_dispatch;
+                }
+
+                auto it = m_types.find(type);
+                if (it == m_types.end())
+                {
+                    it = m_types.emplace(type, resolve(type, *m_converters)).first;
+                }
+                return it->second;
+            }
+
+#ifdef PYBIND11_JSON_STATS
+            counting_handler<Handler> m_handler;
+#else
+            Handler& m_handler;
+#endif
+            const options& m_options;
+            // Keeps the converters of m_types alive
+            std::shared_ptr<const converter_map> m_converters = converters();
+            std::unordered_map<PyTypeObject*, dispatch> m_types;
+            std::vector<const PyObject*> m_ancestors;
+            std::size_t m_depth = 0;
+            bool m_sort_keys;
+            std::string m_scratch;
+            std::string* m_error = nullptr;
+            bool m_failed = false;
+            memo_table<memo_value>* m_memo = nullptr;
+            std::unique_ptr<memo_table<memo_value>> m_own_memo;
+        };
+
+        /*
+         * Builds a basic_json tree from py_walker events, the same way
+         * nlohmann's json_sax_dom_parser does: the stack holds the open
+         * containers and values are appended to the innermost one.
+         */
+        template <class BasicJsonType>
+        class json_builder
+        {
+        public:
+            explicit json_builder(BasicJsonType& root)
+                : m_root(root)
+            {
+            }
+
+            void null()
+            {
+                put(nullptr);
+            }
+
+            void boolean(bool val)
+            {
+                put(val);
+            }
+
+            void number_integer(typename BasicJsonType::number_integer_t val)
+            {
+                put(val);
+            }
+
+            void number_unsigned(typename BasicJsonType::number_unsigned_t val)
+            {
+                put(val);
+            }
+
+            void number_float(double val)
+            {
+                put(val);
+            }
+
+            void string(const char* data, std::size_t size)
+            {
+                put(typename BasicJsonType::string_t(data, size));
+            }
+
+#ifdef PYBIND11_JSON_HAS_BINARY
+            void binary(const char* data, std::size_t size)
+            {
+                const std::uint8_t* bytes = reinterpret_cast<const std::uint8_t*>(data);
+                put(BasicJsonType::binary(typename BasicJsonType::binary_t::container_type(bytes, bytes + size)));
+            }
+#endif
+
+            void start_array(std::size_t size)
+            {
+                BasicJsonType* array = put(BasicJsonType::array());
+                array->template get_ref<typename BasicJsonType::array_t&>().reserve(size);
+                m_stack.push_back(array);
+            }
+
+            void end_array()
+            {
+                m_stack.pop_back();
+            }
+
+            void start_object(std::size_t)
+            {
+                m_stack.push_back(put(BasicJsonType::object()));
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                m_key.assign(data, size);
+            }
+
+            void end_object()
+            {
+                m_stack.pop_back();
+            }
+
+            // A whole subtree, e.g. a memoized container
+            void value(const BasicJsonType& val)
+            {
+                put(val);
+            }
+
+        private:
+
+            template <class Value>
+            BasicJsonType* put(Value&& val)
+            {
+                if (m_stack.empty())
+                {
+                    m_root = BasicJsonType(std::forward<Value>(val));
+                    return &m_root;
+                }
+
+                BasicJsonType& parent = *m_stack.back();
+                if (parent.is_array())
+                {
+                    typename BasicJsonType::array_t& array = parent.template get_ref<typename BasicJsonType::array_t&>();
+                    array.emplace_back(std::forward<Value>(val));
+                    return &array.back();
+                }
+
+                BasicJsonType& slot = parent[m_key];
+                slot = BasicJsonType(std::forward<Value>(val));
+                return &slot;
+            }
+
+            BasicJsonType& m_root;
+            std::vector<BasicJsonType*> m_stack;
+            typename BasicJsonType::string_t m_key;
+        };
+
+        // Writes the exponent of the scientific notation of nl::json::dump,
+        // with a sign and at least two digits
+        inline char* append_exponent(char* first, int exponent)
+        {
+            *first++ = exponent < 0 ? '-' : '+';
+            unsigned int value = static_cast<unsigned int>(exponent < 0 ? -exponent : exponent);
+            if (value >= 100)
+            {
+                *first++ = static_cast<char>('0' + value / 100);
+                value %= 100;
+            }
+            *first++ = static_cast<char>('0' + value / 10);
+            *first++ = static_cast<char>('0' + value % 10);
+            return first;
+        }
+
+        /*
+         * Lays out the `len` significant digits at `first`, worth
+         * d.ddd * 10^exponent, like nl::json::dump: fixed notation from 1e-5
+         * up to 15 integer digits, with a trailing ".0" for integral values,
+         * and scientific notation otherwise.
+         */
+        inline char* layout_digits(char* first, int len, int exponent)
+        {
+            const int max_integer_digits = std::numeric_limits<double>::digits10;
+            // Position of the decimal point relative to the first digit
+            const int point = exponent + 1;
+            if (len <= point && point <= max_integer_digits)
+            {
+                std::memset(first + len, '0', static_cast<std::size_t>(point - len));
+                first[point] = '.';
+                first[point + 1] = '0';
+                return first + point + 2;
+            }
+            if (0 < point && point <= max_integer_digits)
+            {
+                std::memmove(first + point + 1, first + point, static_cast<std::size_t>(len - point));
+                first[point] = '.';
+                return first + len + 1;
+            }
+            if (-4 < point && point <= 0)
+            {
+                std::memmove(first + 2 - point, first, static_cast<std::size_t>(len));
+                first[0] = '0';
+                first[1] = '.';
+                std::memset(first + 2, '0', static_cast<std::size_t>(-point));
+                return first + 2 - point + len;
+            }
+            if (len > 1)
+            {
+                std::memmove(first + 2, first + 1, static_cast<std::size_t>(len - 1));
+                first[1] = '.';
+                ++len;
+            }
+            first[len] = 'e';
+            return append_exponent(first + len + 1, exponent);
+        }
+
+        /*
+         * Writes a finite double with at most `precision` significant digits
+         * (0: shortest round trip), laid out like nl::json::dump. `first`
+         * must have room for 32 characters.
+         */
+        inline char* format_double(char* first, double val, int precision)
+        {
+#ifndef PYBIND11_JSON_HAS_TO_CHARS
+            if (precision <= 0 || precision >= 17)
+            {
+                // No shortest round-trip formatter without std::to_chars,
+                // nlohmann's one is reached through its public API
+                const std::string text = nl::json(val).dump();
+                return std::copy(text.begin(), text.end(), first);
+            }
+#endif
+            if (std::signbit(val))
+            {
+                *first++ = '-';
+                val = -val;
+            }
+
+            // Scientific notation, d.ddde[+-]xx
+            char* end = first;
+#ifdef PYBIND11_JSON_HAS_TO_CHARS
+            if (precision <= 0)
+            {
+                // Shortest of fixed and scientific notation. Fixed notation with
+                // at most 15 integer digits is the layout of nl::json::dump,
+                // except for the ".0" of integral values.
+                end = std::to_chars(first, first + 31, val).ptr;
+                if (std::find(first, end, 'e') == end)
+                {
+                    char* point = std::find(first, end, '.');
+                    if (point - first <= std::numeric_limits<double>::digits10)
+                    {
+                        if (point == end)
+                        {
+                            *end++ = '.';
+                            *end++ = '0';
+                        }
+                        return end;
+                    }
+                    end = std::to_chars(first, first + 31, val, std::chars_format::scientific).ptr;
+                }
+            }
+            else
+            {
+                end = std::to_chars(first, first + 31, val, std::chars_format::scientific, std::min(precision, 17) - 1).ptr;
+            }
+#else
+            end += std::snprintf(first, 31, "%.*e", precision - 1, val);
+#endif
+            // Digits are moved in place to the front
+            int len = 0;
+            const char* cur = first;
+            for (; cur != end && *cur != 'e'; ++cur)
+            {
+                // Skips the decimal point, whatever the locale
+                if (*cur >= '0' && *cur <= '9')
+                {
+                    first[len++] = *cur;
+                }
+            }
+            while (len > 1 && first[len - 1] == '0')
+            {
+                --len;
+            }
+
+            int exponent = 0;
+            bool negative = ++cur < end && *cur == '-';
+            for (cur += (cur < end && (*cur == '-' || *cur == '+')) ? 1 : 0; cur < end; ++cur)
+            {
+                exponent = exponent * 10 + (*cur - '0');
+            }
+            exponent = negative ? -exponent : exponent;
+
+            return layout_digits(first, len, exponent);
+        }
+
+        /*
+         * Writes py_walker events as JSON text, following the exact layout
+         * of nlohmann's serializer so that the output matches nl::json::dump.
+         */
+        class text_writer
+        {
+        public:
+            text_writer(std::string& out, const dump_options& opts)
+                : m_out(out), m_options(opts)
+            {
+            }
+
+            void null()
+            {
+                before_value();
+                m_out.append("null", 4);
+            }
+
+            void boolean(bool val)
+            {
+                before_value();
+                if (val)
+                {
+                    m_out.append("true", 4);
+                }
+                else
+                {
+                    m_out.append("false", 5);
+                }
+            }
+
+            void number_integer(nl::json::number_integer_t val)
+            {
+                before_value();
+                if (val < 0)
+                {
+                    m_out.push_back('-');
+                    // Negate in unsigned arithmetic to handle the minimum value
+                    write_unsigned(0u - static_cast<std::uint64_t>(val));
+                }
+                else
+                {
+                    write_unsigned(static_cast<std::uint64_t>(val));
+                }
+            }
+
+            void number_unsigned(nl::json::number_unsigned_t val)
+            {
+                before_value();
+                write_unsigned(static_cast<std::uint64_t>(val));
+            }
+
+            void number_float(double val)
+            {
+                before_value();
+                if (!std::isfinite(val))
+                {
+                    m_out.append("null", 4);
+                    return;
+                }
+                char buffer[32];
+                char* end = format_double(buffer, val, m_options.float_precision);
+                m_out.append(buffer, static_cast<std::size_t>(end - buffer));
+            }
+
+            void string(const char* data, std::size_t size)
+            {
+                before_value();
+                write_string(data, size);
+            }
+
+            // Same layout as nl::json::dump for binary values
+            void binary(const char* data, std::size_t size)
+            {
+                before_value();
+                const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+                if (pretty())
+                {
+                    m_out.append("{", 1);
+                    newline(m_empty.size() + 1);
+                    m_out.append("\"bytes\": [", 10);
+                    for (std::size_t i = 0; i < size; ++i)
+                    {
+                        if (i != 0)
+                        {
+                            m_out.append(", ", 2);
+                        }
+                        write_unsigned(bytes[i]);
+                    }
+                    m_out.append("],", 2);
+                    newline(m_empty.size() + 1);
+                    m_out.append("\"subtype\": null", 15);
+                    newline(m_empty.size());
+                    m_out.push_back('}');
+                }
+                else
+                {
+                    m_out.append("{\"bytes\":[", 10);
+                    for (std::size_t i = 0; i < size; ++i)
+                    {
+                        if (i != 0)
+                        {
+                            m_out.push_back(',');
+                        }
+                        write_unsigned(bytes[i]);
+                    }
+                    m_out.append("],\"subtype\":null}", 17);
+                }
+            }
+
+            void start_array(std::size_t)
+            {
+                before_value();
+                m_out.push_back('[');
+                m_empty.push_back(true);
+            }
+
+            void end_array()
+            {
+                close(']');
+            }
+
+            void start_object(std::size_t)
+            {
+                before_value();
+                m_out.push_back('{');
+                m_empty.push_back(true);
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                next_item();
+                write_string(data, size);
+                if (pretty())
+                {
+                    m_out.append(": ", 2);
+                }
+                else
+                {
+                    m_out.push_back(':');
+                }
+                m_after_key = true;
+            }
+
+            void end_object()
+            {
+                close('}');
+            }
+
+        private:
+
+            bool pretty() const
+            {
+                return m_options.indent >= 0;
+            }
+
+            void before_value()
+            {
+                if (m_after_key)
+                {
+                    m_after_key = false;
+                }
+                else if (!m_empty.empty())
+                {
+                    next_item();
+                }
+            }
+
+            void next_item()
+            {
+                if (m_empty.back())
+                {
+                    m_empty.back() = false;
+                }
+                else
+                {
+                    m_out.push_back(',');
+                }
+                if (pretty())
+                {
+                    newline(m_empty.size());
+                }
+            }
+
+            void close(char bracket)
+            {
+                bool empty = m_empty.back();
+                m_empty.pop_back();
+                if (!empty && pretty())
+                {
+                    newline(m_empty.size());
+                }
+                m_out.push_back(bracket);
+            }
+
+            void newline(std::size_t level)
+            {
+                m_out.push_back('\n');
+                m_out.append(level * static_cast<std::size_t>(m_options.indent), m_options.indent_char);
+            }
+
+            void write_unsigned(std::uint64_t val)
+            {
+                char buffer[20];
+                char* end = buffer + sizeof(buffer);
+                char* begin = end;
+                do
+                {
+                    *--begin = static_cast<char>('0' + val % 10);
+                    val /= 10;
+                }
+                while (val != 0);
+                m_out.append(begin, static_cast<std::size_t>(end - begin));
+            }
+
+            void write_escaped_codepoint(std::uint32_t codepoint)
+            {
+                static const char hex[] = "0123456789abcdef";
+                char buffer[6] = { '\\', 'u', 0, 0, 0, 0 };
+                for (int i = 5; i >= 2; --i)
+                {
+                    buffer[i] = hex[codepoint & 0xFu];
+                    codepoint >>= 4;
+                }
+                m_out.append(buffer, 6);
+            }
+
+            void write_string(const char* data, std::size_t size)
+            {
+                m_out.reserve(m_out.size() + size + 2);
+                m_out.push_back('"');
+
+                std::size_t run = 0;
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    unsigned char c = static_cast<unsigned char>(data[i]);
+                    if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x7F || !m_options.ensure_ascii))
+                    {
+                        continue;
+                    }
+
+                    m_out.append(data + run, i - run);
+                    switch (c)
+                    {
+                        case '\b': m_out.append("\\b", 2); break;
+                        case '\t': m_out.append("\\t", 2); break;
+                        case '\n': m_out.append("\\n", 2); break;
+                        case '\f': m_out.append("\\f", 2); break;
+                        case '\r': m_out.append("\\r", 2); break;
+                        case '"': m_out.append("\\\"", 2); break;
+                        case '\\': m_out.append("\\\\", 2); break;
+                        default:
+                        {
+                            if (c < 0x80)
+                            {
+                                write_escaped_codepoint(c);
+                                break;
+                            }
+
+                            // ensure_ascii: decode the UTF-8 sequence and
+                            // escape it, using a surrogate pair if needed
+                            std::size_t length = c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : 2);
+                            std::uint32_t codepoint = c & (0x7Fu >> length);
+                            for (std::size_t k = 1; k < length && i + k < size; ++k)
+                            {
+                                codepoint = (codepoint << 6) | (static_cast<unsigned char>(data[i + k]) & 0x3Fu);
+                            }
+                            if (codepoint <= 0xFFFF)
+                            {
+                                write_escaped_codepoint(codepoint);
+                            }
+                            else
+                            {
+                                write_escaped_codepoint(0xD7C0u + (codepoint >> 10u));
+                                write_escaped_codepoint(0xDC00u + (codepoint & 0x3FFu));
+                            }
+                            i += length - 1;
+                            break;
+                        }
+                    }
+                    run = i + 1;
+                }
+                m_out.append(data + run, size - run);
+
+                m_out.push_back('"');
+            }
+
+            std::string& m_out;
+            const dump_options& m_options;
+            std::vector<bool> m_empty;
+            bool m_after_key = false;
+        };
+    }
+
+    /*
+     * Monotonic memory arena. Blocks are carved out of large chunks and
+     * are only given back all at once, by release() or the destructor.
+     * release() keeps the largest chunk, so that an arena reused for
+     * similar requests stops allocating from the heap.
+     */
+    class arena
+    {
+    public:
+        explicit arena(std::size_t chunk_size = 64 * 1024)
+            : m_chunk_size(chunk_size)
+        {
+        }
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        ~arena()
+        {
+            free_chunks(m_chunks);
+        }
+
+        // Returns size bytes aligned on alignof(std::max_align_t)
+        void* allocate(std::size_t size)
+        {
+            size = align(size);
+            if (size > static_cast<std::size_t>(m_end - m_current))
+            {
+                grow(size);
+            }
+            void* block = m_current;
+            m_current += size;
+            m_used += size;
+            return block;
+        }
+
+        void release()
+        {
+            if (m_chunks != nullptr)
+            {
+                free_chunks(m_chunks->next);
+                m_chunks->next = nullptr;
+                m_current = reinterpret_cast<char*>(m_chunks) + align(sizeof(chunk));
+                m_end = m_current + m_chunks->capacity;
+            }
+            m_used = 0;
+        }
+
+        // Bytes handed out since the last release
+        std::size_t used() const
+        {
+            return m_used;
+        }
+
+    private:
+
+        struct chunk
+        {
+            chunk* next;
+            std::size_t capacity;
+        };
+
+        static void free_chunks(chunk* c)
+        {
+            while (c != nullptr)
+            {
+                chunk* next = c->next;
+                ::operator delete(c);
+                c = next;
+            }
+        }
+
+        static std::size_t align(std::size_t size)
+        {
+            const std::size_t alignment = alignof(std::max_align_t);
+            return (size + alignment - 1) & ~(alignment - 1);
+        }
+
+        void grow(std::size_t size)
+        {
+            const std::size_t header = align(sizeof(chunk));
+            const std::size_t capacity = std::max(size, m_chunk_size);
+            chunk* c = static_cast<chunk*>(::operator new(header + capacity));
+            c->next = m_chunks;
+            c->capacity = capacity;
+            m_chunks = c;
+            m_current = reinterpret_cast<char*>(c) + header;
+            m_end = m_current + capacity;
+            // Chunks grow geometrically, so that big trees need few of them
+            const std::size_t max_chunk_size = 64 * 1024 * 1024;
+            m_chunk_size = std::max(m_chunk_size, std::min(2 * m_chunk_size, max_chunk_size));
+        }
+
+        chunk* m_chunks = nullptr;
+        char* m_current = nullptr;
+        char* m_end = nullptr;
+        std::size_t m_chunk_size;
+        std::size_t m_used = 0;
+    };
+
+    namespace detail
+    {
+        inline arena*& current_arena()
+        {
+            static thread_local arena* instance = nullptr;
+            return instance;
+        }
+    }
+
+    /*
+     * Makes `a` the arena used by arena_allocator on the current thread
+     * until the scope ends.
+     */
+    class arena_scope
+    {
+    public:
+        explicit arena_scope(arena& a)
+            : m_previous(detail::current_arena())
+        {
+            detail::current_arena() = &a;
+        }
+
+        arena_scope(const arena_scope&) = delete;
+        arena_scope& operator=(const arena_scope&) = delete;
+
+        ~arena_scope()
+        {
+            detail::current_arena() = m_previous;
+        }
+
+    private:
+
+        arena* m_previous;
+    };
+
+    namespace detail
+    {
+        /*
+         * Stateless allocator drawing from the arena of the current
+         * arena_scope, or from the heap outside of any scope. nlohmann
+         * default-constructs its allocators, so the arena cannot be carried by
+         * the allocator itself: each block starts with a header recording where
+         * it comes from, which lets values be copied, modified and destroyed
+         * outside of the scope. Deallocating an arena block is a no-op.
+         */
+        template <class T>
+        class arena_allocator
+        {
+        public:
+            using value_type = T;
+
+            arena_allocator() noexcept = default;
+
+            template <class U>
+            arena_allocator(const arena_allocator<U>&) noexcept
+            {
+            }
+
+            T* allocate(std::size_t n)
+            {
+                static_assert(alignof(T) <= alignof(std::max_align_t), "arena_allocator does not support over-aligned types");
+                if (n > (std::numeric_limits<std::size_t>::max() - header_size) / sizeof(T))
+                {
+                    throw std::bad_alloc();
+                }
+                const std::size_t size = header_size + n * sizeof(T);
+                arena* a = detail::current_arena();
+                void* block = a != nullptr ? a->allocate(size) : ::operator new(size);
+                *static_cast<arena**>(block) = a;
+                return reinterpret_cast<T*>(static_cast<char*>(block) + header_size);
+            }
+
+            void deallocate(T* p, std::size_t) noexcept
+            {
+                char* block = reinterpret_cast<char*>(p) - header_size;
+                if (*reinterpret_cast<arena**>(block) == nullptr)
+                {
+                    ::operator delete(block);
+                }
+            }
+
+            template <class U>
+            bool operator==(const arena_allocator<U>&) const noexcept
+            {
+                return true;
+            }
+
+            template <class U>
+            bool operator!=(const arena_allocator<U>&) const noexcept
+            {
+                return false;
+            }
+
+        private:
+
+            static constexpr std::size_t header_size = alignof(std::max_align_t);
+        };
+    }
+
+    // In detail so that argument-dependent lookup from an arena_json does
+    // not consider the to_json overloads of pyjson
+    using detail::arena_allocator;
+
+    using arena_string = std::basic_string<char, std::char_traits<char>, arena_allocator<char>>;
+
+    /*
+     * basic_json whose nodes, strings, arrays and objects live in an arena.
+     * A tree must be destroyed before its arena is released; destroying it
+     * is cheap since no block goes back to the heap.
+     */
+    using arena_json = nl::basic_json<std::map, std::vector, arena_string, bool, std::int64_t, std::uint64_t, double, arena_allocator>;
+
+    template <class BasicJsonType = nl::json>
+    inline BasicJsonType to_json(const py::handle& obj, std::set<const PyObject*>& refs, const options& opts = options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("to_json");
+        BasicJsonType out;
+        detail::json_builder<BasicJsonType> builder(out);
+        detail::py_walker<detail::json_builder<BasicJsonType>> walker(builder, opts);
+        walker.add_ancestors(refs.begin(), refs.end());
+        walker.walk(obj);
+        return out;
+    }
+
+    /*
+     * to_json for objects which may not be convertible, e.g. when resolving
+     * overloads: returns false and sets `error` instead of throwing for
+     * unsupported types, cycles, out-of-range integers and invalid keys.
+     * Unsupported top-level types are rejected before any work. Python
+     * errors raised while reading the objects are still thrown.
+     */
+    template <class BasicJsonType>
+    inline bool try_to_json(const py::handle& obj, BasicJsonType& out, std::string& error, const options& opts = options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("to_json");
+        if (!detail::is_convertible(obj))
+        {
+            // Unlike repr, the type name cannot run Python code
+            error = std::string("to_json not implemented for this type of object: ") + Py_TYPE(obj.ptr())->tp_name;
+            return false;
+        }
+
+        BasicJsonType result;
+        detail::json_builder<BasicJsonType> builder(result);
+        detail::py_walker<detail::json_builder<BasicJsonType>> walker(builder, opts);
+        walker.report_errors(error);
+        walker.walk(obj);
+        if (walker.failed())
+        {
+            return false;
+        }
+        out = std::move(result);
+        return true;
+    }
+
+    namespace detail
+    {
+        inline std::string& load_error()
+        {
+            static thread_local std::string error;
+            return error;
+        }
+    }
+
+    // Why the last conversion of a bound function argument to JSON failed
+    // on this thread, e.g. to report it when no overload matched. Empty
+    // when that conversion succeeded.
+    inline const std::string& last_load_error()
+    {
+        return detail::load_error();
+    }
+
+#ifdef PYBIND11_JSON_PARALLEL
+    namespace detail
+    {
+        /*
+         * Converts the items of a large top-level list or tuple on several
+         * threads. Items are handed out in small batches from a shared
+         * counter, so that threads which finish early take over the
+         * remaining work, and each one is written to its own slot of the
+         * output array. Returns false when the serial path must be used.
+         */
+        template <class BasicJsonType>
+        inline bool to_json_parallel(const py::handle& obj, const options& opts, BasicJsonType& out)
+        {
+            std::size_t threads = opts.threads != 0 ? opts.threads : std::thread::hardware_concurrency();
+            bool nested = opts.cycles != cycle_check::depth || opts.max_depth > 0;
+            if (threads <= 1 || !nested || !(py::isinstance<py::list>(obj) || py::isinstance<py::tuple>(obj)))
+            {
+                return false;
+            }
+
+            // Only large sequences are worth a snapshot and threads
+            const Py_ssize_t length = PyList_Check(obj.ptr()) ? PyList_GET_SIZE(obj.ptr()) : PyTuple_GET_SIZE(obj.ptr());
+            if (static_cast<std::size_t>(length) < opts.parallel_min_size || length < 2)
+            {
+                return false;
+            }
+
+            // Work on a snapshot, other threads may modify a list meanwhile
+            const py::tuple items = PyList_Check(obj.ptr()) ? list_snapshot(obj) : py::reinterpret_borrow<py::tuple>(obj);
+            const std::size_t size = static_cast<std::size_t>(PyTuple_GET_SIZE(items.ptr()));
+            if (size < 2)
+            {
+                return false;
+            }
+
+            out = BasicJsonType::array();
+            typename BasicJsonType::array_t& array = out.template get_ref<typename BasicJsonType::array_t&>();
+            array.resize(size);
+
+            threads = std::min(threads, size);
+            const std::size_t batch = std::max<std::size_t>(64, size / (threads * 16));
+            const PyObject* parent = obj.ptr();
+            std::atomic<std::size_t> next(0);
+            std::atomic<bool> failed(false);
+            std::exception_ptr error;
+            std::mutex error_mutex;
+
+#ifdef PYBIND11_JSON_STATS
+            // Each thread counts apart, from the level of the items
+            stats_state* stats = current_stats();
+            std::mutex stats_mutex;
+            PYBIND11_JSON_COUNT(start(false, size));
+#endif
+            auto work = [&]()
+            {
+#ifdef PYBIND11_JSON_STATS
+                stats_fork fork(stats, stats_mutex);
+#endif
+                try
+                {
+                    // One walker per thread, so that its dispatch cache
+                    // serves the whole batch; each item is built in `item`
+                    // and then moved to its slot
+                    BasicJsonType item;
+                    json_builder<BasicJsonType> builder(item);
+                    py_walker<json_builder<BasicJsonType>> walker(builder, opts);
+                    walker.add_ancestors(&parent, &parent + 1);
+                    std::size_t begin;
+                    while (!failed && (begin = next.fetch_add(batch)) < size)
+                    {
+                        const std::size_t end = std::min(begin + batch, size);
+                        for (std::size_t i = begin; i < end; ++i)
+                        {
+                            walker.walk(PyTuple_GET_ITEM(items.ptr(), static_cast<Py_ssize_t>(i)));
+                            array[i] = std::move(item);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            };
+
+            std::vector<std::thread> workers;
+            workers.reserve(threads - 1);
+            for (std::size_t i = 1; i < threads; ++i)
+            {
+                workers.emplace_back([&work]()
+                {
+                    py::gil_scoped_acquire acquire;
+                    work();
+                });
+            }
+            work();
+            {
+                // Detach while waiting, so that the workers are never
+                // blocked on this thread (e.g. by a stop-the-world collection)
+                py::gil_scoped_release release;
+                for (std::thread& worker : workers)
+                {
+                    worker.join();
+                }
+            }
+
+            PYBIND11_JSON_COUNT(end(size));
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            return true;
+        }
+    }
+#endif
+
+    template <class BasicJsonType = nl::json>
+    inline BasicJsonType to_json(const py::handle& obj, const options& opts = options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("to_json");
+        BasicJsonType out;
+#ifdef PYBIND11_JSON_PARALLEL
+        if (detail::to_json_parallel(obj, opts, out))
+        {
+            return out;
+        }
+#endif
+        detail::json_builder<BasicJsonType> builder(out);
+        detail::py_walker<detail::json_builder<BasicJsonType>> walker(builder, opts);
+        walker.walk(obj);
+        return out;
+    }
+
+    /*
+     * Builds the tree in `a`: a whole request's tree can then be dropped
+     * without a free per node.
+     */
+    inline arena_json to_json(const py::handle& obj, arena& a, const options& opts = options())
+    {
+        arena_scope scope(a);
+        return to_json<arena_json>(obj, opts);
+    }
+
+    /*
+     * Serializes a Python object to JSON text without building an
+     * intermediate nl::json. The text is appended to `out`; with the default
+     * options it has the layout of to_json(obj).dump(), but with
+     * std::to_chars floats are written with their shortest round-trip
+     * digits, as Python's repr does, where nlohmann's grisu2 sometimes
+     * emits one more digit.
+     */
+    inline void dump(const py::handle& obj, std::string& out, const dump_options& opts = dump_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("dump");
+        detail::text_writer writer(out, opts);
+        detail::py_walker<detail::text_writer> walker(writer, opts, opts.sort_keys);
+        walker.walk(obj);
+    }
+
+    inline std::string dumps(const py::handle& obj, const dump_options& opts = dump_options())
+    {
+        std::string out;
+        dump(obj, out, opts);
+        return out;
+    }
+
+    /*
+     * GIL-friendly variants for multi-threaded embedders: the Python side
+     * (reading or building objects) runs with the GIL held, while the
+     * native side (parsing or serializing text) runs with the GIL
+     * released, through an intermediate JSON tree.
+     */
+    namespace detail
+    {
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+        // Keeps the keys in document order, like loads
+        using parsed_json = nl::ordered_json;
+#else
+        using parsed_json = nl::json;
+#endif
+
+        inline parsed_json parse_without_gil(const py::bytes& text)
+        {
+            char* data = nullptr;
+            Py_ssize_t size = 0;
+            if (PyBytes_AsStringAndSize(text.ptr(), &data, &size) != 0)
+            {
+                throw py::error_already_set();
+            }
+
+            // `text` is immutable and kept alive by the caller
+            py::gil_scoped_release release;
+            return parsed_json::parse(data, data + size);
+        }
+
+        template <class BasicJsonType>
+        inline py::bytes dump_without_gil(const py::handle& obj, const dump_options& opts)
+        {
+            BasicJsonType j = to_json<BasicJsonType>(obj, opts);
+            std::string text;
+            {
+                // Same writer as dump, so that floats honour float_precision
+                // and the text is identical to dumps(obj, opts)
+                py::gil_scoped_release release;
+                text_writer writer(text, opts);
+                walk_json(j, writer, [&writer](const char* data, std::size_t size) { writer.binary(data, size); });
+                j = nullptr;
+            }
+            return py::bytes(text.data(), text.size());
+        }
+    }
+
+    inline py::object loads_bytes(const py::bytes& text)
+    {
+        PYBIND11_JSON_STATS_SCOPE("loads_bytes");
+        return from_json(detail::parse_without_gil(text));
+    }
+
+    inline py::object loads_bytes(const py::bytes& text, key_cache& keys)
+    {
+        PYBIND11_JSON_STATS_SCOPE("loads_bytes");
+        return from_json(detail::parse_without_gil(text), keys);
+    }
+
+    inline py::bytes dumps_to_bytes(const py::handle& obj, const dump_options& opts = dump_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("dumps_to_bytes");
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+        if (!opts.sort_keys)
+        {
+            return detail::dump_without_gil<nl::ordered_json>(obj, opts);
+        }
+#endif
+        return detail::dump_without_gil<nl::json>(obj, opts);
+    }
+
+    /*
+     * JSON Lines (NDJSON): one JSON document per line.
+     */
+    namespace detail
+    {
+        // Reads at most `size` bytes without the GIL; returns 0 at the end of the file
+        inline std::size_t read_fd(int fd, char* data, std::size_t size)
+        {
+            py::gil_scoped_release release;
+            for (;;)
+            {
+#ifdef _WIN32
+                int count = ::_read(fd, data, static_cast<unsigned int>((std::min)(size, std::size_t(1) << 30)));
+#else
+                ssize_t count = ::read(fd, data, size);
+#endif
+                if (count >= 0)
+                {
+                    return static_cast<std::size_t>(count);
+                }
+                if (errno != EINTR)
+                {
+                    throw std::system_error(errno, std::generic_category(), "cannot read JSON lines");
+                }
+            }
+        }
+
+        // Writes all of `data` without touching Python state, whether the
+        // calling thread holds the GIL or not
+        inline void raw_write_fd(int fd, const char* data, std::size_t size)
+        {
+            while (size > 0)
+            {
+#ifdef _WIN32
+                int count = ::_write(fd, data, static_cast<unsigned int>((std::min)(size, std::size_t(1) << 30)));
+#else
+                ssize_t count = ::write(fd, data, size);
+#endif
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "cannot write JSON lines");
+                }
+                data += count;
+                size -= static_cast<std::size_t>(count);
+            }
+        }
+
+        inline void write_fd(int fd, const char* data, std::size_t size)
+        {
+            py::gil_scoped_release release;
+            raw_write_fd(fd, data, size);
+        }
+
+        inline bool is_blank(const char* begin, const char* end)
+        {
+            for (; begin != end; ++begin)
+            {
+                if (*begin != ' ' && *begin != '\t' && *begin != '\r')
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    /*
+     * Reads JSON lines in batches of Python objects, either from a file
+     * descriptor read in large chunks without the GIL, or from memory (e.g.
+     * a memory-mapped file) without copying. Blank lines are skipped and
+     * object keys are shared between lines through a key_cache. Parse errors
+     * throw nl::json::parse_error; line() is then the line which failed.
+     * The reader holds Python references: destroy it with the GIL held.
+     */
+    class ndjson_reader
+    {
+    public:
+
+        explicit ndjson_reader(int fd, std::size_t chunk_size = std::size_t(1) << 20)
+            : m_fd(fd), m_chunk_size(chunk_size > 0 ? chunk_size : 1), m_eof(false)
+        {
+        }
+
+        ndjson_reader(const char* data, std::size_t size)
+            : m_fd(-1), m_chunk_size(0), m_data(data), m_size(size), m_eof(true)
+        {
+        }
+
+        // Parses up to `max_items` lines; the batch is empty at the end of the input
+        py::list next_batch(std::size_t max_items = 1024)
+        {
+            PYBIND11_JSON_STATS_SCOPE("ndjson_reader");
+            py::list batch;
+            detail::py_builder builder(&m_keys);
+            const char* begin = nullptr;
+            const char* end = nullptr;
+            while (batch.size() < max_items && next_line(begin, end))
+            {
+                if (detail::is_blank(begin, end))
+                {
+                    continue;
+                }
+                nl::json::sax_parse(begin, end, &builder);
+                if (PyList_Append(batch.ptr(), builder.result().ptr()) != 0)
+                {
+                    throw py::error_already_set();
+                }
+            }
+            return batch;
+        }
+
+        bool done() const
+        {
+            return m_eof && m_pos == m_size;
+        }
+
+        // Number of lines read so far, blank lines included
+        std::size_t line() const
+        {
+            return m_line;
+        }
+
+    private:
+
+        bool next_line(const char*& begin, const char*& end)
+        {
+            for (;;)
+            {
+                const char* start = m_data + m_pos;
+                const char* stop = m_data + m_size;
+                const char* newline = m_scanned < m_size
+                    ? static_cast<const char*>(std::memchr(m_data + m_scanned, '\n', m_size - m_scanned))
+                    : nullptr;
+                if (newline != nullptr)
+                {
+                    begin = start;
+                    end = newline;
+                    m_pos = m_scanned = static_cast<std::size_t>(newline - m_data) + 1;
+                    ++m_line;
+                    return true;
+                }
+                m_scanned = m_size;
+                if (m_eof)
+                {
+                    if (start == stop)
+                    {
+                        return false;
+                    }
+                    begin = start;
+                    end = stop;
+                    m_pos = m_size;
+                    ++m_line;
+                    return true;
+                }
+                fill();
+            }
+        }
+
+        // Keeps the incomplete last line and appends the next chunk to it
+        void fill()
+        {
+            const std::size_t remaining = m_size - m_pos;
+            if (remaining > 0)
+            {
+                std::memmove(m_buffer.data(), m_buffer.data() + m_pos, remaining);
+            }
+            m_scanned -= m_pos;
+            m_pos = 0;
+            m_buffer.resize((std::max)(m_buffer.size(), remaining + m_chunk_size));
+
+            std::size_t count = detail::read_fd(m_fd, m_buffer.data() + remaining, m_buffer.size() - remaining);
+            m_eof = count == 0;
+            m_data = m_buffer.data();
+            m_size = remaining + count;
+        }
+
+        int m_fd;
+        std::size_t m_chunk_size;
+        std::vector<char> m_buffer;
+        const char* m_data = nullptr;
+        std::size_t m_size = 0;
+        std::size_t m_pos = 0;
+        std::size_t m_scanned = 0;
+        std::size_t m_line = 0;
+        bool m_eof;
+        key_cache m_keys;
+    };
+
+    /*
+     * Appends the items of a Python iterable to `out` as JSON lines. The
+     * options are those of dump, except that the output is always compact.
+     * When an item cannot be converted, `out` keeps the lines before it.
+     */
+    inline void dump_lines(const py::handle& items, std::string& out, const dump_options& opts = dump_options())
+    {
+        PYBIND11_JSON_STATS_SCOPE("dump_lines");
+        dump_options line_options = opts;
+        line_options.indent = -1;
+        for (const py::handle item : items)
+        {
+            // A record which cannot be converted leaves no partial line
+            const std::size_t size = out.size();
+            try
+            {
+                dump(item, out, line_options);
+            }
+            catch (...)
+            {
+                out.resize(size);
+                throw;
+            }
+            out.push_back('\n');
+        }
+    }
+
+    /*
+     * Writes Python objects as JSON lines to a file descriptor. Lines are
+     * serialized into one buffer which is written without the GIL when it
+     * exceeds `buffer_size`. The destructor flushes silently and touches no
+     * Python state, so that a writer may be destroyed with or without the
+     * GIL: call flush() to report write errors.
+     */
+    class ndjson_writer
+    {
+    public:
+
+        explicit ndjson_writer(int fd, const dump_options& opts = dump_options(), std::size_t buffer_size = std::size_t(1) << 20)
+            : m_fd(fd), m_options(opts), m_buffer_size(buffer_size)
+        {
+            m_options.indent = -1;
+        }
+
+        ndjson_writer(const ndjson_writer&) = delete;
+        ndjson_writer& operator=(const ndjson_writer&) = delete;
+
+        ~ndjson_writer()
+        {
+            try
+            {
+                detail::raw_write_fd(m_fd, m_buffer.data(), m_buffer.size());
+            }
+            catch (...)
+            {
+            }
+        }
+
+        // An object which cannot be converted leaves the output unchanged
+        void write(const py::handle& obj)
+        {
+            const std::size_t size = m_buffer.size();
+            try
+            {
+                dump(obj, m_buffer, m_options);
+            }
+            catch (...)
+            {
+                m_buffer.resize(size);
+                throw;
+            }
+            m_buffer.push_back('\n');
+            if (m_buffer.size() >= m_buffer_size)
+            {
+                flush();
+            }
+        }
+
+        void write_all(const py::handle& items)
+        {
+            for (const py::handle item : items)
+            {
+                write(item);
+            }
+        }
+
+        void flush()
+        {
+            if (!m_buffer.empty())
+            {
+                detail::write_fd(m_fd, m_buffer.data(), m_buffer.size());
+                m_buffer.clear();
+            }
+        }
+
+    private:
+
+        int m_fd;
+        dump_options m_options;
+        std::size_t m_buffer_size;
+        std::string m_buffer;
+    };
+
+#ifdef PYBIND11_JSON_HAS_BINARY
+    namespace detail
+    {
+        /*
+         * Base of the py_walker handlers writing binary formats: big or
+         * little endian numbers appended to a byte vector.
+         */
+        class byte_writer
+        {
+        public:
+            explicit byte_writer(std::vector<std::uint8_t>& out)
+                : m_out(out)
+            {
+            }
+
+        protected:
+
+            void put(std::uint8_t byte)
+            {
+                m_out.push_back(byte);
+            }
+
+            void put(const char* data, std::size_t size)
+            {
+                m_out.insert(m_out.end(), reinterpret_cast<const std::uint8_t*>(data), reinterpret_cast<const std::uint8_t*>(data) + size);
+            }
+
+            template <class Number>
+            void put_number(Number val, bool little_endian = false)
+            {
+                std::uint8_t bytes[sizeof(Number)];
+                std::memcpy(bytes, &val, sizeof(Number));
+                const std::uint16_t probe = 1;
+                bool native_little_endian = *reinterpret_cast<const std::uint8_t*>(&probe) == 1;
+                if (native_little_endian != little_endian)
+                {
+                    std::reverse(bytes, bytes + sizeof(Number));
+                }
+                m_out.insert(m_out.end(), bytes, bytes + sizeof(Number));
+            }
+
+            // nlohmann writes floats which survive the round trip as 32 bits
+            static bool fits_float(double val)
+            {
+                return val >= static_cast<double>(std::numeric_limits<float>::lowest())
+                    && val <= static_cast<double>((std::numeric_limits<float>::max)())
+                    && static_cast<double>(static_cast<float>(val)) == val;
+            }
+
+            std::vector<std::uint8_t>& m_out;
+        };
+
+        // Same encoding as nl::json::to_cbor
+        class cbor_writer : public byte_writer
+        {
+        public:
+            using byte_writer::byte_writer;
+
+            void null()
+            {
+                put(0xF6);
+            }
+
+            void boolean(bool val)
+            {
+                put(val ? 0xF5 : 0xF4);
+            }
+
+            void number_integer(std::int64_t val)
+            {
+                if (val >= 0)
+                {
+                    head(0x00, static_cast<std::uint64_t>(val));
+                }
+                else
+                {
+                    head(0x20, static_cast<std::uint64_t>(-1 - val));
+                }
+            }
+
+            void number_unsigned(std::uint64_t val)
+            {
+                head(0x00, val);
+            }
+
+            void number_float(double val)
+            {
+                if (std::isnan(val))
+                {
+                    put(0xF9);
+                    put(0x7E);
+                    put(0x00);
+                }
+                else if (std::isinf(val))
+                {
+                    put(0xF9);
+                    put(val > 0 ? 0x7C : 0xFC);
+                    put(0x00);
+                }
+                else if (fits_float(val))
+                {
+                    put(0xFA);
+                    put_number(static_cast<float>(val));
+                }
+                else
+                {
+                    put(0xFB);
+                    put_number(val);
+                }
+            }
+
+            void string(const char* data, std::size_t size)
+            {
+                head(0x60, size);
+                put(data, size);
+            }
+
+            void binary(const char* data, std::size_t size)
+            {
+                head(0x40, size);
+                put(data, size);
+            }
+
+            void start_array(std::size_t size)
+            {
+                head(0x80, size);
+            }
+
+            void end_array()
+            {
+            }
+
+            void start_object(std::size_t size)
+            {
+                head(0xA0, size);
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                string(data, size);
+            }
+
+            void end_object()
+            {
+            }
+
+        private:
+
+            // Major type and argument, in the shortest form
+            void head(std::uint8_t major, std::uint64_t val)
+            {
+                if (val <= 0x17)
+                {
+                    put(static_cast<std::uint8_t>(major + val));
+                }
+                else if (val <= (std::numeric_limits<std::uint8_t>::max)())
+                {
+                    put(static_cast<std::uint8_t>(major + 0x18));
+                    put_number(static_cast<std::uint8_t>(val));
+                }
+                else if (val <= (std::numeric_limits<std::uint16_t>::max)())
+                {
+                    put(static_cast<std::uint8_t>(major + 0x19));
+                    put_number(static_cast<std::uint16_t>(val));
+                }
+                else if (val <= (std::numeric_limits<std::uint32_t>::max)())
+                {
+                    put(static_cast<std::uint8_t>(major + 0x1A));
+                    put_number(static_cast<std::uint32_t>(val));
+                }
+                else
+                {
+                    put(static_cast<std::uint8_t>(major + 0x1B));
+                    put_number(val);
+                }
+            }
+        };
+
+        // Same encoding as nl::json::to_msgpack
+        class msgpack_writer : public byte_writer
         {
-            py::list obj(j.size());
-            for (std::size_t i = 0; i < j.size(); i++)
+        public:
+            using byte_writer::byte_writer;
+
+            void null()
             {
-                obj[i] = from_json(j[i]);
+                put(0xC0);
             }
-            return obj;
-        }
-        else // Object
-        {
-            py::dict obj;
-            for (nl::json::const_iterator it = j.cbegin(); it != j.cend(); ++it)
+
+            void boolean(bool val)
             {
-                obj[py::str(it.key())] = from_json(it.value());
+                put(val ? 0xC3 : 0xC2);
             }
-            return obj;
-        }
-    }
 
-    inline nl::json to_json(const py::handle& obj, std::set<const PyObject*>& refs)
-    {
-        if (obj.ptr() == nullptr || obj.is_none())
-        {
-            return nullptr;
-        }
-        if (py::isinstance<py::bool_>(obj))
-        {
-            return obj.cast<bool>();
-        }
-        if (py::isinstance<py::int_>(obj))
-        {
-            try
+            void number_integer(std::int64_t val)
             {
-                nl::json::number_integer_t s = obj.cast<nl::json::number_integer_t>();
-                if (py::int_(s).equal(obj))
+                if (val >= 0)
+                {
+                    number_unsigned(static_cast<std::uint64_t>(val));
+                }
+                else if (val >= -32)
+                {
+                    put_number(static_cast<std::int8_t>(val));
+                }
+                else if (val >= (std::numeric_limits<std::int8_t>::min)())
+                {
+                    put(0xD0);
+                    put_number(static_cast<std::int8_t>(val));
+                }
+                else if (val >= (std::numeric_limits<std::int16_t>::min)())
+                {
+                    put(0xD1);
+                    put_number(static_cast<std::int16_t>(val));
+                }
+                else if (val >= (std::numeric_limits<std::int32_t>::min)())
+                {
+                    put(0xD2);
+                    put_number(static_cast<std::int32_t>(val));
+                }
+                else
                 {
-                    return s;
+                    put(0xD3);
+                    put_number(val);
                 }
             }
-            catch (...)
+
+            void number_unsigned(std::uint64_t val)
+            {
+                if (val < 128)
+                {
+                    put(static_cast<std::uint8_t>(val));
+                }
+                else if (val <= (std::numeric_limits<std::uint8_t>::max)())
+                {
+                    put(0xCC);
+                    put_number(static_cast<std::uint8_t>(val));
+                }
+                else if (val <= (std::numeric_limits<std::uint16_t>::max)())
+                {
+                    put(0xCD);
+                    put_number(static_cast<std::uint16_t>(val));
+                }
+                else if (val <= (std::numeric_limits<std::uint32_t>::max)())
+                {
+                    put(0xCE);
+                    put_number(static_cast<std::uint32_t>(val));
+                }
+                else
+                {
+                    put(0xCF);
+                    put_number(val);
+                }
+            }
+
+            void number_float(double val)
             {
+                if (fits_float(val))
+                {
+                    put(0xCA);
+                    put_number(static_cast<float>(val));
+                }
+                else
+                {
+                    put(0xCB);
+                    put_number(val);
+                }
             }
-            try
+
+            void string(const char* data, std::size_t size)
             {
-                nl::json::number_unsigned_t u = obj.cast<nl::json::number_unsigned_t>();
-                if (py::int_(u).equal(obj))
+                if (size <= 31)
+                {
+                    put(static_cast<std::uint8_t>(0xA0 | size));
+                }
+                else
                 {
-                    return u;
+                    head(size, 0xD9, 0xDA, 0xDB);
                 }
+                put(data, size);
             }
-            catch (...)
+
+            void binary(const char* data, std::size_t size)
             {
+                head(size, 0xC4, 0xC5, 0xC6);
+                put(data, size);
             }
-            throw std::runtime_error("to_json received an integer out of range for both nl::json::number_integer_t and nl::json::number_unsigned_t type: " + py::repr(obj).cast<std::string>());
-        }
-        if (py::isinstance<py::float_>(obj))
-        {
-            return obj.cast<double>();
-        }
-        if (py::isinstance<py::bytes>(obj))
-        {
-            py::module base64 = py::module::import("base64");
-            return base64.attr("b64encode")(obj).attr("decode")("utf-8").cast<std::string>();
-        }
-        if (py::isinstance<py::str>(obj))
-        {
-            return obj.cast<std::string>();
-        }
-        if (py::isinstance<py::tuple>(obj) || py::isinstance<py::list>(obj))
+
+            void start_array(std::size_t size)
+            {
+                if (size <= 15)
+                {
+                    put(static_cast<std::uint8_t>(0x90 | size));
+                }
+                else
+                {
+                    head(size, 0, 0xDC, 0xDD);
+                }
+            }
+
+            void end_array()
+            {
+            }
+
+            void start_object(std::size_t size)
+            {
+                if (size <= 15)
+                {
+                    put(static_cast<std::uint8_t>(0x80 | size));
+                }
+                else
+                {
+                    head(size, 0, 0xDE, 0xDF);
+                }
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                string(data, size);
+            }
+
+            void end_object()
+            {
+            }
+
+        private:
+
+            // Type byte for an 8, 16 or 32 bit length, followed by the
+            // length. Containers have no 8 bit form (type8 == 0).
+            void head(std::size_t size, std::uint8_t type8, std::uint8_t type16, std::uint8_t type32)
+            {
+                if (type8 != 0 && size <= (std::numeric_limits<std::uint8_t>::max)())
+                {
+                    put(type8);
+                    put_number(static_cast<std::uint8_t>(size));
+                }
+                else if (size <= (std::numeric_limits<std::uint16_t>::max)())
+                {
+                    put(type16);
+                    put_number(static_cast<std::uint16_t>(size));
+                }
+                else if (size <= (std::numeric_limits<std::uint32_t>::max)())
+                {
+                    put(type32);
+                    put_number(static_cast<std::uint32_t>(size));
+                }
+                else
+                {
+                    throw std::runtime_error("to_msgpack received a value larger than 4 GiB");
+                }
+            }
+        };
+
+        // Same encoding as nl::json::to_ubjson without count and type
+        // optimizations
+        class ubjson_writer : public byte_writer
         {
-            auto insert_ret = refs.insert(obj.ptr());
-            if (!insert_ret.second) {
-                throw std::runtime_error("Circular reference detected");
+        public:
+            using byte_writer::byte_writer;
+
+            void null()
+            {
+                put('Z');
+            }
+
+            void boolean(bool val)
+            {
+                put(val ? 'T' : 'F');
+            }
+
+            void number_integer(std::int64_t val)
+            {
+                if (val >= (std::numeric_limits<std::int8_t>::min)() && val <= (std::numeric_limits<std::int8_t>::max)())
+                {
+                    put('i');
+                    put_number(static_cast<std::int8_t>(val));
+                }
+                else if (val >= 0 && val <= (std::numeric_limits<std::uint8_t>::max)())
+                {
+                    put('U');
+                    put_number(static_cast<std::uint8_t>(val));
+                }
+                else if (val >= (std::numeric_limits<std::int16_t>::min)() && val <= (std::numeric_limits<std::int16_t>::max)())
+                {
+                    put('I');
+                    put_number(static_cast<std::int16_t>(val));
+                }
+                else if (val >= (std::numeric_limits<std::int32_t>::min)() && val <= (std::numeric_limits<std::int32_t>::max)())
+                {
+                    put('l');
+                    put_number(static_cast<std::int32_t>(val));
+                }
+                else
+                {
+                    put('L');
+                    put_number(val);
+                }
+            }
+
+            void number_unsigned(std::uint64_t val)
+            {
+                if (val <= static_cast<std::uint64_t>((std::numeric_limits<std::int64_t>::max)()))
+                {
+                    number_integer(static_cast<std::int64_t>(val));
+                    return;
+                }
+
+                // High-precision number, as a decimal string
+                std::string digits = std::to_string(val);
+                put('H');
+                number_integer(static_cast<std::int64_t>(digits.size()));
+                put(digits.data(), digits.size());
             }
 
-            auto out = nl::json::array();
-            for (const py::handle value : obj)
+            void number_float(double val)
             {
-                out.push_back(to_json(value, refs));
+                put('D');
+                put_number(val);
             }
 
-            refs.erase(insert_ret.first);
+            void string(const char* data, std::size_t size)
+            {
+                put('S');
+                text(data, size);
+            }
 
-            return out;
-        }
-        if (py::isinstance<py::dict>(obj))
+            // No binary type: bytes are written as an array of uint8
+            void binary(const char* data, std::size_t size)
+            {
+                put('[');
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    put('U');
+                    put(static_cast<std::uint8_t>(data[i]));
+                }
+                put(']');
+            }
+
+            void start_array(std::size_t)
+            {
+                put('[');
+            }
+
+            void end_array()
+            {
+                put(']');
+            }
+
+            void start_object(std::size_t)
+            {
+                put('{');
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                text(data, size);
+            }
+
+            void end_object()
+            {
+                put('}');
+            }
+
+        private:
+
+            void text(const char* data, std::size_t size)
+            {
+                number_integer(static_cast<std::int64_t>(size));
+                put(data, size);
+            }
+        };
+
+        /*
+         * Same encoding as nl::json::to_bson. Documents are prefixed with
+         * their size in bytes, which is patched in once they are closed.
+         */
+        class bson_writer : public byte_writer
         {
-            auto insert_ret = refs.insert(obj.ptr());
-            if (!insert_ret.second) {
-                throw std::runtime_error("Circular reference detected");
+        public:
+            using byte_writer::byte_writer;
+
+            void null()
+            {
+                element(0x0A);
+            }
+
+            void boolean(bool val)
+            {
+                element(0x08);
+                put(val ? 0x01 : 0x00);
+            }
+
+            void number_integer(std::int64_t val)
+            {
+                if (val >= (std::numeric_limits<std::int32_t>::min)() && val <= (std::numeric_limits<std::int32_t>::max)())
+                {
+                    element(0x10);
+                    put_number(static_cast<std::int32_t>(val), true);
+                }
+                else
+                {
+                    element(0x12);
+                    put_number(val, true);
+                }
+            }
+
+            void number_unsigned(std::uint64_t val)
+            {
+                if (val > static_cast<std::uint64_t>((std::numeric_limits<std::int64_t>::max)()))
+                {
+                    throw std::runtime_error("to_bson received an integer which does not fit int64: " + std::to_string(val));
+                }
+                number_integer(static_cast<std::int64_t>(val));
+            }
+
+            void number_float(double val)
+            {
+                element(0x01);
+                put_number(val, true);
             }
 
-            auto out = nl::json::object();
-            for (const py::handle key : obj)
+            void string(const char* data, std::size_t size)
             {
-                out[py::str(key).cast<std::string>()] = to_json(obj[key], refs);
+                element(0x02);
+                put_number(static_cast<std::int32_t>(size + 1), true);
+                put(data, size);
+                put(0x00);
             }
 
-            refs.erase(insert_ret.first);
+            void binary(const char* data, std::size_t size)
+            {
+                element(0x05);
+                put_number(static_cast<std::int32_t>(size), true);
+                put(0x00); // generic subtype
+                put(data, size);
+            }
 
-            return out;
+            void start_array(std::size_t)
+            {
+                element(0x04);
+                open(true);
+            }
+
+            void end_array()
+            {
+                close();
+            }
+
+            void start_object(std::size_t)
+            {
+                if (!m_stack.empty())
+                {
+                    element(0x03);
+                }
+                open(false);
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                const void* nul = std::memchr(data, 0, size);
+                if (nul != nullptr)
+                {
+                    throw std::runtime_error("to_bson received a key containing U+0000: " + std::string(data, size));
+                }
+                m_key.assign(data, size);
+            }
+
+            void end_object()
+            {
+                close();
+            }
+
+        private:
+
+            struct document
+            {
+                std::size_t offset; // of the size field
+                bool is_array;
+                std::size_t index;
+            };
+
+            // Element header: type, then the key as a C string. Arrays are
+            // documents keyed by the indices.
+            void element(std::uint8_t type)
+            {
+                if (m_stack.empty())
+                {
+                    throw std::runtime_error("to_bson requires a dict at the top level");
+                }
+                put(type);
+                document& parent = m_stack.back();
+                if (parent.is_array)
+                {
+                    std::string index = std::to_string(parent.index++);
+                    put(index.data(), index.size());
+                }
+                else
+                {
+                    put(m_key.data(), m_key.size());
+                }
+                put(0x00);
+            }
+
+            void open(bool is_array)
+            {
+                m_stack.push_back(document{m_out.size(), is_array, 0});
+                put_number(std::int32_t(0), true);
+            }
+
+            void close()
+            {
+                put(0x00);
+                std::size_t offset = m_stack.back().offset;
+                m_stack.pop_back();
+
+                std::uint32_t size = static_cast<std::uint32_t>(m_out.size() - offset);
+                for (std::size_t i = 0; i < 4; ++i)
+                {
+                    m_out[offset + i] = static_cast<std::uint8_t>(size >> (8 * i));
+                }
+            }
+
+            std::vector<document> m_stack;
+            std::string m_key;
+        };
+
+        // Binary formats always map bytes to their binary type and emit
+        // object keys in nl::json order, like nlohmann's writers.
+        template <class Writer>
+        inline void write_binary(const py::handle& obj, std::vector<std::uint8_t>& out, const options& opts)
+        {
+            options binary_options = opts;
+            binary_options.bytes = bytes_mode::binary;
+            PYBIND11_JSON_STATS_SCOPE("to_binary");
+            Writer writer(out);
+            py_walker<Writer> walker(writer, binary_options, true);
+            walker.walk(obj);
         }
 
-        throw std::runtime_error("to_json not implemented for this type of object: " + py::repr(obj).cast<std::string>());
+        inline py::object read_binary(const std::uint8_t* data, std::size_t size, nl::json::input_format_t format, key_cache* keys)
+        {
+            PYBIND11_JSON_STATS_SCOPE("from_binary");
+            py_builder builder(keys);
+            nl::json::sax_parse(data, data + size, &builder, format);
+            return std::move(builder.result());
+        }
     }
 
-    inline nl::json to_json(const py::handle& obj)
-    {
-        std::set<const PyObject*> refs;
-        return to_json(obj, refs);
+    /*
+     * Python objects to and from CBOR, MessagePack, UBJSON and BSON without
+     * an intermediate nl::json. The encodings follow nlohmann_json 3.11,
+     * whose to_cbor(to_json(obj)) and friends give the same bytes, with
+     * bytes stored as binary values. Older releases size some floats
+     * differently (e.g. CBOR NaN and infinities, which 3.11 writes as half
+     * floats), which decodes to the same values. Decoding errors throw
+     * nl::json::parse_error.
+     */
+    #define PYBIND11_JSON_BINARY_FORMAT(NAME, FORMAT)                                                         \
+    inline void to_##NAME(const py::handle& obj, std::vector<std::uint8_t>& out,                              \
+                          const options& opts = options())                                                    \
+    {                                                                                                         \
+        detail::write_binary<detail::NAME##_writer>(obj, out, opts);                                          \
+    }                                                                                                         \
+                                                                                                              \
+    inline std::vector<std::uint8_t> to_##NAME(const py::handle& obj, const options& opts = options())       \
+    {                                                                                                         \
+        std::vector<std::uint8_t> out;                                                                        \
+        detail::write_binary<detail::NAME##_writer>(obj, out, opts);                                          \
+        return out;                                                                                           \
+    }                                                                                                         \
+                                                                                                              \
+    inline py::object from_##NAME(const std::uint8_t* data, std::size_t size)                                 \
+    {                                                                                                         \
+        return detail::read_binary(data, size, nl::json::input_format_t::FORMAT, nullptr);                    \
+    }                                                                                                         \
+                                                                                                              \
+    inline py::object from_##NAME(const std::vector<std::uint8_t>& data)                                      \
+    {                                                                                                         \
+        return detail::read_binary(data.data(), data.size(), nl::json::input_format_t::FORMAT, nullptr);      \
+    }                                                                                                         \
+                                                                                                              \
+    inline py::object from_##NAME(const std::vector<std::uint8_t>& data, key_cache& keys)                     \
+    {                                                                                                         \
+        return detail::read_binary(data.data(), data.size(), nl::json::input_format_t::FORMAT, &keys);        \
     }
 
+    PYBIND11_JSON_BINARY_FORMAT(cbor, cbor)
+    PYBIND11_JSON_BINARY_FORMAT(msgpack, msgpack)
+    PYBIND11_JSON_BINARY_FORMAT(ubjson, ubjson)
+    PYBIND11_JSON_BINARY_FORMAT(bson, bson)
+
+    #undef PYBIND11_JSON_BINARY_FORMAT
+#endif
+
 }
 
 // nlohmann_json serializers
@@ -170,12 +5360,15 @@ namespace nlohmann
     template <>                                            \
     struct adl_serializer<T>                               \
     {                                                      \
-        inline static void to_json(json& j, const T& obj)  \
+        template <class BasicJsonType>                     \
+        inline static void to_json(BasicJsonType& j,       \
+                                   const T& obj)           \
         {                                                  \
-            j = pyjson::to_json(obj);                      \
+            j = pyjson::to_json<BasicJsonType>(obj);       \
         }                                                  \
                                                            \
-        inline static T from_json(const json& j)           \
+        template <class BasicJsonType>                     \
+        inline static T from_json(const BasicJsonType& j)  \
         {                                                  \
             return pyjson::from_json(j);                   \
         }                                                  \
@@ -185,9 +5378,11 @@ namespace nlohmann
     template <>                                            \
     struct adl_serializer<T>                               \
     {                                                      \
-        inline static void to_json(json& j, const T& obj)  \
+        template <class BasicJsonType>                     \
+        inline static void to_json(BasicJsonType& j,       \
+                                   const T& obj)           \
         {                                                  \
-            j = pyjson::to_json(obj);                      \
+            j = pyjson::to_json<BasicJsonType>(obj);       \
         }                                                  \
     }
 
@@ -219,29 +5414,91 @@ namespace pybind11
 {
     namespace detail
     {
-        template <> struct type_caster<nl::json>
+        template <>
+        struct type_caster<pyjson::json_view>
         {
         public:
-            PYBIND11_TYPE_CASTER(nl::json, _("json"));
+            PYBIND11_TYPE_CASTER(pyjson::json_view, _("JsonView"));
 
             bool load(handle src, bool)
             {
+                if (pyjson::detail::is_view(src.ptr()))
+                {
+                    const auto* view = reinterpret_cast<const pyjson::detail::view_object*>(src.ptr());
+                    value = pyjson::json_view(view->root, *view->node);
+                    return true;
+                }
+                PYBIND11_JSON_STATS_SCOPE("type_caster");
+                pyjson::detail::load_error().clear();
                 try
                 {
-                    value = pyjson::to_json(src);
+                    nl::json j;
+                    if (!pyjson::try_to_json(src, j, pyjson::detail::load_error()))
+                    {
+                        return false;
+                    }
+                    value = pyjson::json_view(std::move(j));
                     return true;
                 }
+                catch (const std::exception& e)
+                {
+                    pyjson::detail::load_error() = e.what();
+                    return false;
+                }
+                catch (...)
+                {
+                    pyjson::detail::load_error() = "unknown exception";
+                    return false;
+                }
+            }
+
+            static handle cast(const pyjson::json_view& src, return_value_policy /* policy */, handle /* parent */)
+            {
+                return pyjson::make_view(src).release();
+            }
+        };
+
+        template <class BasicJsonType>
+        struct type_caster<BasicJsonType, typename std::enable_if<nl::detail::is_basic_json<BasicJsonType>::value>::type>
+        {
+        public:
+            PYBIND11_TYPE_CASTER(BasicJsonType, _("json"));
+
+            // Mismatching objects fail without exceptions, leaving the reason
+            // in pyjson::last_load_error()
+            bool load(handle src, bool)
+            {
+                PYBIND11_JSON_STATS_SCOPE("type_caster");
+                pyjson::detail::load_error().clear();
+                try
+                {
+                    return pyjson::try_to_json(src, value, pyjson::detail::load_error());
+                }
+                catch (const std::exception& e)
+                {
+                    pyjson::detail::load_error() = e.what();
+                    return false;
+                }
                 catch (...)
                 {
+                    pyjson::detail::load_error() = "unknown exception";
                     return false;
                 }
             }
 
-            static handle cast(nl::json src, return_value_policy /* policy */, handle /* parent */)
+            static handle cast(const BasicJsonType& src, return_value_policy /* policy */, handle /* parent */)
             {
+                PYBIND11_JSON_STATS_SCOPE("type_caster");
                 object obj = pyjson::from_json(src);
                 return obj.release();
             }
+
+            static handle cast(BasicJsonType&& src, return_value_policy /* policy */, handle /* parent */)
+            {
+                PYBIND11_JSON_STATS_SCOPE("type_caster");
+                object obj = pyjson::from_json(std::move(src));
+                return obj.release();
+            }
         };
     }
 }
@@ -9,11 +9,18 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
 
 #include "gtest/gtest.h"
 
 #include "pybind11_json/pybind11_json.hpp"
+#include "pybind11_json/file.hpp"
 
 #include "pybind11/embed.h"
 
@@ -27,6 +34,15 @@ inline py::module create_module(const std::string& module_name)
     return py::module_::create_extension_module(module_name.c_str(), nullptr, new py::module_::module_def);
 }
 
+// Clears the registered converters when a test ends, even on a failed assertion
+struct converters_guard
+{
+    ~converters_guard()
+    {
+        pyjson::clear_converters();
+    }
+};
+
 TEST(nljson_serializers_tojson, none)
 {
     py::scoped_interpreter guard;
@@ -83,6 +99,43 @@ TEST(nljson_serializers_tojson, integer)
     ASSERT_THROW(nl::json j_large_outside = obj_large_outside, std::runtime_error);
 }
 
+TEST(nljson_serializers_tojson, integer_overflow_policy)
+{
+    py::scoped_interpreter guard;
+    py::int_ big = py::int_(std::numeric_limits<nl::json::number_unsigned_t>::max()).attr("__add__")(1);
+    py::int_ small = py::int_(std::numeric_limits<nl::json::number_integer_t>::min()).attr("__sub__")(1);
+
+    pyjson::options options;
+    options.on_int_overflow = pyjson::int_overflow::string;
+
+    nl::json j_big = pyjson::to_json(big, options);
+    ASSERT_TRUE(j_big.is_string());
+    ASSERT_EQ(j_big.get<std::string>(), "18446744073709551616");
+
+    nl::json j_small = pyjson::to_json(small, options);
+    ASSERT_TRUE(j_small.is_string());
+    ASSERT_EQ(j_small.get<std::string>(), "-9223372036854775809");
+
+    options.on_int_overflow = pyjson::int_overflow::float_;
+
+    j_big = pyjson::to_json(big, options);
+    ASSERT_TRUE(j_big.is_number_float());
+    ASSERT_EQ(j_big.get<double>(), 18446744073709551616.0);
+
+    py::int_ huge = py::int_(10).attr("__pow__")(400);
+    ASSERT_THROW(pyjson::to_json(huge, options), std::runtime_error);
+
+    // Values in range are not affected by the policy
+    nl::json j = pyjson::to_json(py::int_(-36), options);
+    ASSERT_TRUE(j.is_number_integer());
+    ASSERT_EQ(j.get<int>(), -36);
+
+    pyjson::dump_options dump_options;
+    dump_options.on_int_overflow = pyjson::int_overflow::string;
+    ASSERT_EQ(pyjson::dumps(py::make_tuple(big, 1), dump_options), "[\"18446744073709551616\",1]");
+    ASSERT_THROW(pyjson::dumps(big), std::runtime_error);
+}
+
 TEST(nljson_serializers_tojson, float_)
 {
     py::scoped_interpreter guard;
@@ -278,6 +331,131 @@ TEST(nljson_serializers_tojson, obj_attr_accessor)
     ASSERT_TRUE(j.is_string());
 }
 
+TEST(pyjson_dump, scalars)
+{
+    py::scoped_interpreter guard;
+    py::list obj;
+    obj.append(py::none());
+    obj.append(py::bool_(true));
+    obj.append(py::int_(-36));
+    obj.append(py::int_(std::numeric_limits<nl::json::number_integer_t>::min()));
+    obj.append(py::int_(std::numeric_limits<nl::json::number_unsigned_t>::max()));
+    obj.append(py::float_(36.37));
+    obj.append(py::float_(-0.0));
+    obj.append(py::float_(1e100));
+    obj.append(py::float_(INFINITY));
+    obj.append(py::float_(NAN));
+    obj.append(py::bytes("\x00\x01binary", 8));
+
+    ASSERT_EQ(pyjson::dumps(obj), pyjson::to_json(obj).dump());
+}
+
+TEST(pyjson_dump, strings)
+{
+    py::scoped_interpreter guard;
+    py::list obj;
+    obj.append("Hello World!");
+    obj.append("quote \" backslash \\ slash /");
+    obj.append("\b\f\n\r\t\x01\x1f\x7f");
+    obj.append(py::str("\xc3\xa9t\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80"));
+
+    ASSERT_EQ(pyjson::dumps(obj), pyjson::to_json(obj).dump());
+
+    pyjson::dump_options options;
+    options.ensure_ascii = true;
+    ASSERT_EQ(pyjson::dumps(obj, options), pyjson::to_json(obj).dump(-1, ' ', true));
+}
+
+TEST(pyjson_dump, nested)
+{
+    py::scoped_interpreter guard;
+    py::dict obj(
+        "list"_a=py::make_tuple(1234, "hello", false),
+        "dict"_a=py::dict("b"_a=12, "a"_a=py::list()),
+        "empty"_a=py::dict(),
+        "hello"_a="world",
+        "world"_a=py::none()
+    );
+    obj[py::int_(1)] = "int key";
+    obj[py::str("1")] = "str key";
+
+    ASSERT_EQ(pyjson::dumps(obj), pyjson::to_json(obj).dump());
+
+    pyjson::dump_options options;
+    options.indent = 4;
+    ASSERT_EQ(pyjson::dumps(obj, options), pyjson::to_json(obj).dump(4));
+
+    options.indent = 0;
+    options.indent_char = '\t';
+    ASSERT_EQ(pyjson::dumps(obj, options), pyjson::to_json(obj).dump(0, '\t'));
+}
+
+TEST(pyjson_dump, append)
+{
+    py::scoped_interpreter guard;
+    std::string out = "prefix ";
+    pyjson::dump(py::make_tuple(1, 2), out);
+
+    ASSERT_EQ(out, "prefix [1,2]");
+}
+
+TEST(pyjson_dump, floats)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+import random, struct
+rng = random.Random(42)
+floats = [0.1, 1/3, 2.0, 1e15, 1e16, 1e-5, 5e-324, 1.7976931348623157e308, 2.5177795440463832e16, 116.05656573862029]
+floats += [rng.uniform(-1e3, 1e3) for _ in range(5000)]
+bits = (struct.unpack("<d", struct.pack("<Q", rng.getrandbits(64)))[0] for _ in range(5000))
+floats += [f for f in bits if f == f and abs(f) != float("inf")]
+)");
+    py::object floats = py::module::import("__main__").attr("floats");
+
+    // Round trip, with the shortest digits as Python's repr when std::to_chars is available
+    std::string text = pyjson::dumps(floats);
+    py::object json = py::module::import("json");
+    ASSERT_TRUE(json.attr("loads")(text).equal(floats));
+    ASSERT_TRUE(pyjson::loads(text).equal(floats));
+#ifdef PYBIND11_JSON_HAS_TO_CHARS
+    for (py::handle item : floats)
+    {
+        std::string repr = py::repr(item);
+        std::string own = pyjson::dumps(item);
+        auto digits = [](const std::string& s)
+        {
+            std::string out(s.begin(), std::find(s.begin(), s.end(), 'e'));
+            out.erase(std::remove_if(out.begin(), out.end(), [](char c) { return c < '1' || c > '9'; }), out.end());
+            return out;
+        };
+        ASSERT_EQ(digits(own), digits(repr)) << own << " " << repr;
+    }
+#endif
+
+    pyjson::dump_options options;
+    options.float_precision = 6;
+    py::list values;
+    for (double val : {1.0 / 3, -2.0 / 3, 2.0, -0.0, 1e20, 123456789.0, 9.9999999, 1.5e-7})
+    {
+        values.append(py::float_(val));
+    }
+    ASSERT_EQ(pyjson::dumps(values, options), "[0.333333,-0.666667,2.0,-0.0,1e+20,123457000.0,10.0,1.5e-07]");
+
+    options.float_precision = 17;
+    ASSERT_TRUE(json.attr("loads")(pyjson::dumps(floats, options)).equal(floats));
+}
+
+TEST(pyjson_dump, errors)
+{
+    py::scoped_interpreter guard;
+    py::dict obj;
+    obj["self"] = obj;
+    ASSERT_THROW(pyjson::dumps(obj), std::runtime_error);
+    obj.attr("clear")();
+
+    ASSERT_THROW(pyjson::dumps(py::module::import("sys")), std::runtime_error);
+}
+
 TEST(nljson_serializers_fromjson, none)
 {
     py::scoped_interpreter guard;
@@ -384,6 +562,20 @@ TEST(nljson_serializers_fromjson, string)
     ASSERT_EQ(obj2.cast<std::string>(), "Hello World!");
 }
 
+TEST(nljson_serializers_fromjson, unicode_string)
+{
+    py::scoped_interpreter guard;
+    nl::json j = "\"\xc3\xa9t\xc3\xa9 \\u0000 \xf0\x9f\x98\x80\""_json;
+    py::object obj = j;
+
+    ASSERT_TRUE(py::isinstance<py::str>(obj));
+    ASSERT_EQ(obj.cast<std::string>(), j.get<std::string>());
+    ASSERT_EQ(py::len(obj), 7u);
+
+    nl::json invalid = std::string("\xff");
+    ASSERT_THROW(pyjson::from_json(invalid), py::error_already_set);
+}
+
 TEST(nljson_serializers_fromjson, list)
 {
     py::scoped_interpreter guard;
@@ -446,11 +638,163 @@ TEST(nljson_serializers_fromjson, nested)
     ASSERT_TRUE(py::dict(obj)["hey"].is_none());
 }
 
+TEST(pyjson_loads, scalars)
+{
+    py::scoped_interpreter guard;
+    const char* texts[] = {
+        "null", "false", "36", "-36", "13625394757606569013", "36.2", "-1.5e100", "\"Hello World!\""
+    };
+
+    for (const char* text : texts)
+    {
+        py::object obj = pyjson::loads(text);
+        py::object expected = pyjson::from_json(nl::json::parse(text));
+
+        ASSERT_TRUE(py::type::of(obj).is(py::type::of(expected)));
+        ASSERT_TRUE(obj.equal(expected));
+    }
+}
+
+TEST(pyjson_loads, containers)
+{
+    py::scoped_interpreter guard;
+    const std::string texts[] = {
+        "[1234, \"Hello World!\", false]",
+        "{\"a\": 1234, \"b\":\"Hello World!\", \"c\":false}",
+        "[]",
+        "{}",
+        "{\"a\": 1, \"a\": 2}",
+        R"({
+            "baz": ["one", "two", "three"],
+            "foo": 1,
+            "bar": {"a": 36, "b": false, "c": [[], {}]},
+            "hey": null,
+            "été": "😀"
+        })"
+    };
+
+    for (const std::string& text : texts)
+    {
+        py::object obj = pyjson::loads(text);
+
+        ASSERT_TRUE(obj.equal(pyjson::from_json(nl::json::parse(text))));
+    }
+
+    py::dict obj = pyjson::loads(texts[5]);
+    ASSERT_TRUE(py::isinstance<py::list>(obj["baz"]));
+    ASSERT_TRUE(py::isinstance<py::dict>(obj["bar"]));
+    ASSERT_EQ(obj["bar"]["a"].cast<int>(), 36);
+}
+
+#ifdef PYBIND11_HAS_STRING_VIEW
+TEST(pyjson_loads, string_view)
+{
+    py::scoped_interpreter guard;
+    std::string_view text = "[1, 2, 3] trailing";
+
+    py::list obj = pyjson::loads(text.substr(0, 9));
+    ASSERT_EQ(obj.size(), 3u);
+}
+#endif
+
+TEST(pyjson_loads, errors)
+{
+    py::scoped_interpreter guard;
+
+    ASSERT_THROW(pyjson::loads("[1, 2"), nl::json::parse_error);
+    ASSERT_THROW(pyjson::loads("{\"a\" 1}"), nl::json::parse_error);
+    ASSERT_THROW(pyjson::loads(""), nl::json::parse_error);
+}
+
+TEST(pyjson_key_cache, from_json)
+{
+    py::scoped_interpreter guard;
+    nl::json j = R"([
+        {"id": 1, "name": "a", "tags": {"id": 10}},
+        {"id": 2, "name": "b", "a_key_longer_than_the_limit": true}
+    ])"_json;
+
+    pyjson::key_cache keys(16, 10);
+    py::list obj = pyjson::from_json(j, keys);
+
+    ASSERT_TRUE(obj.equal(pyjson::from_json(j)));
+    ASSERT_EQ(keys.size(), 3u);
+
+    // Repeated keys are the very same interned str object
+    py::list first_keys(obj[0].attr("keys")());
+    py::list second_keys(obj[1].attr("keys")());
+    py::list nested_keys(obj[0]["tags"].attr("keys")());
+    ASSERT_TRUE(first_keys[0].cast<py::object>().is(second_keys[1].cast<py::object>()));
+    ASSERT_TRUE(first_keys[0].cast<py::object>().is(nested_keys[0].cast<py::object>()));
+}
+
+TEST(pyjson_key_cache, loads)
+{
+    py::scoped_interpreter guard;
+    std::string text = R"([{"id": 1, "name": "a"}, {"name": "b", "id": 2}])";
+
+    pyjson::key_cache keys(1);
+    py::list obj = pyjson::loads(text, keys);
+
+    ASSERT_TRUE(obj.equal(pyjson::loads(text)));
+    ASSERT_EQ(keys.size(), 1u);
+
+    py::list first_keys(obj[0].attr("keys")());
+    py::list second_keys(obj[1].attr("keys")());
+    ASSERT_TRUE(first_keys[0].cast<py::object>().is(second_keys[1].cast<py::object>()));
+
+    // Keys past max_size are neither cached nor interned
+    ASSERT_FALSE(first_keys[1].cast<py::object>().is(second_keys[0].cast<py::object>()));
+
+    // The cache is reusable across calls
+    py::list again = pyjson::loads(text, keys);
+    py::list again_keys(again[0].attr("keys")());
+    ASSERT_TRUE(first_keys[0].cast<py::object>().is(again_keys[0].cast<py::object>()));
+
+    keys.clear();
+    ASSERT_EQ(keys.size(), 0u);
+}
+
 inline const nl::json& test_fromtojson(const nl::json& json)
 {
     return json;
 }
 
+TEST(nljson_serializers_fromjson, rvalue)
+{
+    py::scoped_interpreter guard;
+    nl::json j = R"({
+        "baz": ["one", "two", "three"],
+        "foo": 1,
+        "bar": {"a": 36, "b": false},
+        "hey": null
+    })"_json;
+    py::object expected = pyjson::from_json(j);
+
+    py::object obj = pyjson::from_json(std::move(j));
+
+    ASSERT_TRUE(obj.equal(expected));
+    ASSERT_TRUE(j.is_null());
+}
+
+inline nl::json test_return_json()
+{
+    return R"({"number": 1234, "hello": "world"})"_json;
+}
+
+TEST(pybind11_caster_fromjson, by_value)
+{
+    py::scoped_interpreter guard;
+    py::module m = create_module("test");
+
+    m.def("return_json", &test_return_json);
+
+    py::dict j = m.attr("return_json")();
+
+    ASSERT_EQ(j["number"].cast<int>(), 1234);
+    ASSERT_EQ(j["hello"].cast<std::string>(), "world");
+}
+
 TEST(pybind11_caster_tojson, dict)
 {
     py::scoped_interpreter guard;
@@ -500,3 +844,898 @@ TEST(pybind11_caster_tojson, recursive_dict)
     obj["second"]["recur"] = obj_inner;
     ASSERT_ANY_THROW(m.attr("to_json")(obj));
 }
+
+TEST(pyjson_tojson, cycle_check)
+{
+    py::scoped_interpreter guard;
+    py::list deep;
+    py::list inner = deep;
+    for (int i = 0; i < 20; ++i)
+    {
+        py::list next;
+        inner.append(next);
+        inner = next;
+    }
+
+    pyjson::options options;
+    ASSERT_NO_THROW(pyjson::to_json(deep, options));
+
+    options.cycles = pyjson::cycle_check::depth;
+    options.max_depth = 21;
+    ASSERT_NO_THROW(pyjson::to_json(deep, options));
+    options.max_depth = 20;
+    ASSERT_THROW(pyjson::to_json(deep, options), std::runtime_error);
+
+    options.cycles = pyjson::cycle_check::none;
+    ASSERT_EQ(pyjson::to_json(deep, options), pyjson::to_json(deep));
+
+    // A shared, non recursive, child is not a cycle
+    py::dict shared("a"_a=1);
+    py::list obj;
+    obj.append(shared);
+    obj.append(shared);
+    ASSERT_NO_THROW(pyjson::to_json(obj));
+
+    obj.append(obj);
+    ASSERT_THROW(pyjson::to_json(obj), std::runtime_error);
+    options.cycles = pyjson::cycle_check::depth;
+    ASSERT_THROW(pyjson::to_json(obj, options), std::runtime_error);
+    obj.attr("clear")();
+}
+
+TEST(pyjson_tojson, dict_keys)
+{
+    py::scoped_interpreter guard;
+    py::dict obj;
+    obj["b"] = 1;
+    obj["a"] = 2;
+    obj[py::int_(3)] = "int key";
+    obj[py::none()] = "none key";
+
+    nl::json j = pyjson::to_json(obj);
+    ASSERT_EQ(j.size(), 4u);
+    ASSERT_EQ(j["3"].get<std::string>(), "int key");
+    ASSERT_EQ(j["None"].get<std::string>(), "none key");
+
+    pyjson::options options;
+    options.non_str_keys = pyjson::key_policy::skip;
+    j = pyjson::to_json(obj, options);
+    ASSERT_EQ(j, R"({"a": 2, "b": 1})"_json);
+
+    pyjson::dump_options dump_options;
+    dump_options.non_str_keys = pyjson::key_policy::skip;
+    ASSERT_EQ(pyjson::dumps(obj, dump_options), "{\"a\":2,\"b\":1}");
+    dump_options.sort_keys = false;
+    ASSERT_EQ(pyjson::dumps(obj, dump_options), "{\"b\":1,\"a\":2}");
+
+    options.non_str_keys = pyjson::key_policy::error;
+    ASSERT_THROW(pyjson::to_json(obj, options), std::runtime_error);
+
+    // str subclasses are still strings
+    py::object str_subclass = py::eval("type('S', (str,), {'__str__': lambda self: 'other'})");
+    py::dict sub;
+    sub[str_subclass("key")] = 1;
+    ASSERT_EQ(pyjson::to_json(sub, options), R"({"key": 1})"_json);
+    ASSERT_EQ(pyjson::to_json(sub), R"({"other": 1})"_json);
+}
+
+TEST(pyjson_base64, encode_decode)
+{
+    py::scoped_interpreter guard;
+    py::module base64 = py::module::import("base64");
+
+    std::string data;
+    for (std::size_t size = 0; size < 200; ++size)
+    {
+        std::string encoded = pyjson::base64_encode(data.data(), data.size());
+        std::string expected = base64.attr("b64encode")(py::bytes(data)).attr("decode")("ascii").cast<std::string>();
+        ASSERT_EQ(encoded, expected);
+        ASSERT_EQ(pyjson::base64_decode(encoded), data);
+
+        data.push_back(static_cast<char>((size * 37 + 11) % 256));
+    }
+
+    std::string out = "prefix:";
+    pyjson::base64_encode("hello", 5, out);
+    ASSERT_EQ(out, "prefix:aGVsbG8=");
+
+    ASSERT_THROW(pyjson::base64_decode(std::string("aGVsbG8")), std::runtime_error);
+    ASSERT_THROW(pyjson::base64_decode(std::string("aGV$bG8=")), std::runtime_error);
+    ASSERT_THROW(pyjson::base64_decode(std::string("aG=sbG8=")), std::runtime_error);
+    ASSERT_THROW(pyjson::base64_decode(std::string("====")), std::runtime_error);
+}
+
+TEST(pyjson_tojson, bytes)
+{
+    py::scoped_interpreter guard;
+    py::bytes obj("\x00\xff hello", 8);
+
+    nl::json j = pyjson::to_json(obj);
+    ASSERT_TRUE(j.is_string());
+    ASSERT_EQ(j.get<std::string>(), "AP8gaGVsbG8=");
+
+#ifdef PYBIND11_JSON_HAS_BINARY
+    pyjson::options options;
+    options.bytes = pyjson::bytes_mode::binary;
+    j = pyjson::to_json(obj, options);
+    ASSERT_TRUE(j.is_binary());
+    ASSERT_EQ(j.get_binary().size(), 8u);
+    ASSERT_EQ(j.get_binary()[1], 0xff);
+
+    py::object back = pyjson::from_json(j);
+    ASSERT_TRUE(py::isinstance<py::bytes>(back));
+    ASSERT_TRUE(back.equal(obj));
+
+    py::list list;
+    list.append(obj);
+    list.append(py::bytes(""));
+    pyjson::dump_options dump_options;
+    dump_options.bytes = pyjson::bytes_mode::binary;
+    ASSERT_EQ(pyjson::dumps(list, dump_options), pyjson::to_json(list, options).dump());
+    dump_options.indent = 2;
+    ASSERT_EQ(pyjson::dumps(list, dump_options), pyjson::to_json(list, options).dump(2));
+#endif
+}
+
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+inline nl::ordered_json test_ordered_json(const nl::ordered_json& json)
+{
+    nl::ordered_json out = json;
+    out["last"] = true;
+    return out;
+}
+
+TEST(pyjson_basic_json, ordered_json)
+{
+    py::scoped_interpreter guard;
+    py::dict obj;
+    obj["zeta"] = 1;
+    obj["alpha"] = py::list(py::make_tuple("x", 2.5));
+    obj["mid"] = py::none();
+
+    nl::ordered_json j = obj;
+    ASSERT_EQ(j.dump(), R"({"zeta":1,"alpha":["x",2.5],"mid":null})");
+    ASSERT_EQ(pyjson::to_json<nl::ordered_json>(obj), j);
+
+    py::dict back = j;
+    ASSERT_TRUE(back.equal(obj));
+    ASSERT_EQ(py::str(py::list(back)).cast<std::string>(), "['zeta', 'alpha', 'mid']");
+
+    py::module m = create_module("test");
+    m.def("test_ordered_json", &test_ordered_json);
+    py::dict result = m.attr("test_ordered_json")(obj);
+    ASSERT_EQ(py::str(py::list(result)).cast<std::string>(), "['zeta', 'alpha', 'mid', 'last']");
+}
+#endif
+
+TEST(pyjson_basic_json, custom_types)
+{
+    using json_type = nl::basic_json<std::map, std::vector, std::string, bool, std::int32_t, std::uint32_t, float>;
+
+    py::scoped_interpreter guard;
+    py::dict obj;
+    obj["number"] = -12;
+    obj["ratio"] = 0.5;
+    obj["list"] = py::make_tuple(1, "two");
+
+    json_type j = pyjson::to_json<json_type>(obj);
+    ASSERT_TRUE(j["number"].is_number_integer());
+    ASSERT_EQ(j["number"].get<std::int32_t>(), -12);
+    ASSERT_EQ(j["ratio"].get<float>(), 0.5f);
+
+    py::object back = pyjson::from_json(std::move(j));
+    ASSERT_TRUE(back.equal(pyjson::loads(R"({"number": -12, "ratio": 0.5, "list": [1, "two"]})")));
+    ASSERT_TRUE(j.is_null());
+}
+
+TEST(pyjson_arena, to_json)
+{
+    py::scoped_interpreter guard;
+    py::object obj = pyjson::loads(R"({
+        "records": [{"id": 1, "name": "a fairly long name, past any small string buffer"}, {"id": 2, "tags": []}],
+        "flag": true
+    })");
+
+    pyjson::arena arena(256);
+    {
+        pyjson::arena_json j = pyjson::to_json(obj, arena);
+        ASSERT_GT(arena.used(), 0u);
+        pyjson::arena_string text = j.dump();
+        ASSERT_EQ(std::string(text.data(), text.size()), pyjson::to_json(obj).dump());
+        ASSERT_TRUE(pyjson::from_json(j).equal(obj));
+
+        // Values created outside of a scope come from the heap
+        std::size_t used = arena.used();
+        pyjson::arena_json copy = j;
+        copy["records"].push_back("yet another string which does not fit inline");
+        ASSERT_EQ(arena.used(), used);
+        ASSERT_EQ(copy["records"].size(), 3u);
+    }
+    arena.release();
+    ASSERT_EQ(arena.used(), 0u);
+}
+
+TEST(pyjson_gil, loads_bytes)
+{
+    py::scoped_interpreter guard;
+    const char* text = R"({"b": [1, -2, 3.5, "x"], "a": {"nested": null}, "c": true})";
+
+    py::object obj = pyjson::loads_bytes(py::bytes(text));
+    ASSERT_TRUE(obj.equal(pyjson::loads(text)));
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+    // Keys keep the document order, as with loads
+    ASSERT_TRUE(py::list(obj.attr("keys")()).equal(py::list(pyjson::loads(text).attr("keys")())));
+#endif
+
+    pyjson::key_cache keys;
+    ASSERT_TRUE(pyjson::loads_bytes(py::bytes(text), keys).equal(obj));
+    ASSERT_GT(keys.size(), 0u);
+
+    ASSERT_THROW(pyjson::loads_bytes(py::bytes("[1, 2")), nl::json::parse_error);
+}
+
+TEST(pyjson_gil, dumps_to_bytes)
+{
+    py::scoped_interpreter guard;
+    py::object obj = pyjson::loads(R"({"b": [1, -2, 3.5, "\u00e9"], "a": {"nested": null}, "c": true})");
+
+    pyjson::dump_options options;
+    ASSERT_EQ(pyjson::dumps_to_bytes(obj).cast<std::string>(), pyjson::dumps(obj));
+    options.indent = 2;
+    options.ensure_ascii = true;
+    ASSERT_EQ(pyjson::dumps_to_bytes(obj, options).cast<std::string>(), pyjson::dumps(obj, options));
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+    options.sort_keys = false;
+    ASSERT_EQ(pyjson::dumps_to_bytes(obj, options).cast<std::string>(), pyjson::dumps(obj, options));
+#endif
+
+    // Floats go through the writer of dumps, not through nl::json::dump
+    py::list floats;
+    for (double val : {5e-324, 1.0 / 3, 1e22, -0.0})
+    {
+        floats.append(py::float_(val));
+    }
+    pyjson::dump_options float_options;
+    ASSERT_EQ(pyjson::dumps_to_bytes(floats).cast<std::string>(), pyjson::dumps(floats));
+#ifdef PYBIND11_JSON_HAS_TO_CHARS
+    ASSERT_EQ(pyjson::dumps_to_bytes(floats).cast<std::string>(), "[5e-324,0.3333333333333333,1e+22,-0.0]");
+#endif
+    float_options.float_precision = 6;
+    ASSERT_EQ(pyjson::dumps_to_bytes(floats, float_options).cast<std::string>(), "[4.94066e-324,0.333333,1e+22,-0.0]");
+}
+
+TEST(pyjson_tojson, parallel)
+{
+    py::scoped_interpreter guard;
+    py::list obj;
+    for (int i = 0; i < 2000; ++i)
+    {
+        py::dict record;
+        record["id"] = i;
+        record["name"] = "record " + std::to_string(i);
+        record["values"] = py::make_tuple(i, i * 0.5, py::none());
+        obj.append(record);
+    }
+
+    pyjson::options options;
+    options.threads = 4;
+    options.parallel_min_size = 100;
+    ASSERT_EQ(pyjson::to_json(obj, options), pyjson::to_json(obj));
+
+    obj.append(obj);
+    ASSERT_THROW(pyjson::to_json(obj, options), std::runtime_error);
+    obj[2000] = py::module::import("sys");
+    ASSERT_THROW(pyjson::to_json(obj, options), std::runtime_error);
+}
+
+#ifdef PYBIND11_JSON_PARALLEL
+TEST(pyjson_tojson, parallel_concurrent_writes)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+import threading
+
+records = [{"id": i, "tags": ["a", "b"]} for i in range(2000)]
+stop = threading.Event()
+
+def mutate():
+    while not stop.is_set():
+        for record in records:
+            record["extra"] = record.pop("id")
+            record["id"] = record.pop("extra")
+            record["tags"].append("c")
+            del record["tags"][2:]
+
+mutator = threading.Thread(target=mutate)
+mutator.start()
+)");
+    struct stop_guard
+    {
+        ~stop_guard()
+        {
+            py::exec("stop.set()\nmutator.join()");
+        }
+    } stop;
+
+    pyjson::options options;
+    options.threads = 4;
+    options.parallel_min_size = 100;
+    for (int i = 0; i < 20; ++i)
+    {
+        // Each record is written as it was at some point of the conversion
+        nl::json j = pyjson::to_json(py::module::import("__main__").attr("records"), options);
+        ASSERT_EQ(j.size(), 2000u);
+        for (const nl::json& record : j)
+        {
+            ASSERT_TRUE(record.size() == 1 || record.size() == 2);
+            const nl::json& tags = record.at("tags");
+            ASSERT_TRUE(tags.size() == 2 || tags.size() == 3);
+        }
+    }
+}
+#endif
+
+#ifdef PYBIND11_JSON_HAS_BINARY
+TEST(pyjson_binary_formats, encode)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+values = [None, True, False, 0, 23, 24, 255, 256, 65535, 65536, 2**32, 2**63 - 1,
+          -1, -24, -25, -32, -33, -128, -129, -2**15, -2**31, -2**31 - 1, -2**63,
+          0.0, 0.5, -2.25, 1.1, 1e300, float("inf"), float("-inf"),
+          "", "x" * 31, "x" * 32, "y" * 300, "z" * 70000, "été",
+          list(range(15)), list(range(16)), list(range(70000)),
+          {str(i): i for i in range(16)}, {"b": [], "a": {}, "c": {"d": [1, "2"]}}]
+payload = {"values": values, "blob": b"\x00\x01\xff", "big_blob": bytes(300), "nested": [[[]], {}]}
+)");
+    py::object obj = py::module::import("__main__").attr("payload");
+
+    pyjson::options options;
+    options.bytes = pyjson::bytes_mode::binary;
+    nl::json j = pyjson::to_json(obj, options);
+
+    std::vector<std::uint8_t> out = {42};
+    pyjson::to_cbor(obj, out);
+    ASSERT_EQ(out.size(), pyjson::to_cbor(obj).size() + 1);
+
+#if NLOHMANN_JSON_VERSION_MAJOR > 3 || (NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR >= 11)
+    // Same bytes as the nlohmann_json release whose encodings are followed
+    ASSERT_EQ(pyjson::to_cbor(obj), nl::json::to_cbor(j));
+    ASSERT_EQ(pyjson::to_msgpack(obj), nl::json::to_msgpack(j));
+    ASSERT_EQ(pyjson::to_ubjson(obj), nl::json::to_ubjson(j));
+    ASSERT_EQ(pyjson::to_bson(obj), nl::json::to_bson(j));
+
+    py::object big = py::eval("[2**64 - 1, 2**63]");
+    ASSERT_EQ(pyjson::to_cbor(big), nl::json::to_cbor(pyjson::to_json(big)));
+    ASSERT_EQ(pyjson::to_msgpack(big), nl::json::to_msgpack(pyjson::to_json(big)));
+    ASSERT_EQ(pyjson::to_ubjson(big), nl::json::to_ubjson(pyjson::to_json(big)));
+#else
+    // Older releases size some floats differently, but decode to the same values
+    ASSERT_EQ(nl::json::from_cbor(pyjson::to_cbor(obj)), nl::json::from_cbor(nl::json::to_cbor(j)));
+    ASSERT_EQ(nl::json::from_msgpack(pyjson::to_msgpack(obj)), nl::json::from_msgpack(nl::json::to_msgpack(j)));
+    ASSERT_EQ(nl::json::from_ubjson(pyjson::to_ubjson(obj)), nl::json::from_ubjson(nl::json::to_ubjson(j)));
+    ASSERT_EQ(nl::json::from_bson(pyjson::to_bson(obj)), nl::json::from_bson(nl::json::to_bson(j)));
+#endif
+}
+
+TEST(pyjson_binary_formats, decode)
+{
+    py::scoped_interpreter guard;
+    const char* text = R"({"a": [1, -2, 3.5, null, true], "b": {"c": "d"}, "e": []})";
+    py::object obj = pyjson::loads(text);
+    py::dict with_bytes = pyjson::loads(text);
+    with_bytes["f"] = py::bytes("\x00\x01", 2);
+
+    ASSERT_TRUE(pyjson::from_cbor(pyjson::to_cbor(with_bytes)).equal(with_bytes));
+    ASSERT_TRUE(pyjson::from_msgpack(pyjson::to_msgpack(with_bytes)).equal(with_bytes));
+    ASSERT_TRUE(pyjson::from_bson(pyjson::to_bson(with_bytes)).equal(with_bytes));
+    ASSERT_TRUE(pyjson::from_ubjson(pyjson::to_ubjson(obj)).equal(obj));
+
+    std::vector<std::uint8_t> cbor = pyjson::to_cbor(obj);
+    pyjson::key_cache keys;
+    ASSERT_TRUE(pyjson::from_cbor(cbor, keys).equal(obj));
+    ASSERT_TRUE(pyjson::from_cbor(cbor.data(), cbor.size()).equal(obj));
+
+    cbor.pop_back();
+    ASSERT_THROW(pyjson::from_cbor(cbor), nl::json::parse_error);
+}
+
+TEST(pyjson_binary_formats, bson_errors)
+{
+    py::scoped_interpreter guard;
+    ASSERT_THROW(pyjson::to_bson(py::list()), std::runtime_error);
+
+    py::dict obj;
+    obj["value"] = py::eval("2**64 - 1");
+    ASSERT_THROW(pyjson::to_bson(obj), std::runtime_error);
+
+    py::dict nul_key;
+    nul_key[py::str(std::string("a\0b", 3))] = 1;
+    ASSERT_THROW(pyjson::to_bson(nul_key), std::runtime_error);
+}
+#endif
+
+TEST(pyjson_tojson, buffers)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+import array
+buffers = [
+    array.array("d", [0.5, -1.25, 3.0]),
+    array.array("i", [1, -2, 3]),
+    array.array("Q", [0, 2**64 - 1]),
+    memoryview(array.array("h", range(12))).cast("B").cast("h", [3, 4]),
+    memoryview(array.array("f", [1.5, 2.5, 3.5, 4.5]))[::2],
+    memoryview(bytes([0, 1, 1])).cast("?"),
+    bytearray(b"\x00\xff"),
+]
+as_lists = [b.tolist() if hasattr(b, "tolist") else list(b) for b in buffers]
+)");
+    py::object buffers = py::module::import("__main__").attr("buffers");
+    py::object as_lists = py::module::import("__main__").attr("as_lists");
+
+    nl::json j = pyjson::to_json(buffers);
+    ASSERT_EQ(j, pyjson::to_json(as_lists));
+    ASSERT_EQ(j[3].dump(), "[[0,1,2,3],[4,5,6,7],[8,9,10,11]]");
+    ASSERT_EQ(j[4].dump(), "[1.5,3.5]");
+    ASSERT_EQ(pyjson::dumps(buffers), pyjson::dumps(as_lists));
+
+    ASSERT_THROW(pyjson::to_json(py::eval("memoryview(b'ab').cast('c')")), std::runtime_error);
+}
+
+TEST(pyjson_tojson, memoize)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+class Counted:
+    calls = 0
+
+shared = {"z": [1, 2.5, "x"], "a": (True, None, b"\x00"), "c": Counted()}
+tags = ("red", ("nested", 1))
+payload = [{"id": i, "config": shared, "tags": tags} for i in range(10)] + [[tags, tags]]
+)");
+    py::object main = py::module::import("__main__");
+    py::object counted = main.attr("Counted");
+    converters_guard converters;
+    pyjson::register_converter(counted, [counted](const py::handle&)
+    {
+        counted.attr("calls") = counted.attr("calls").cast<int>() + 1;
+        return py::object(py::str("counted"));
+    });
+    py::object payload = main.attr("payload");
+
+    nl::json expected = pyjson::to_json(payload);
+    ASSERT_EQ(counted.attr("calls").cast<int>(), 10);
+
+    for (pyjson::memo_policy policy : {pyjson::memo_policy::immutable, pyjson::memo_policy::all})
+    {
+        pyjson::dump_options options;
+        options.memoize = policy;
+        ASSERT_EQ(pyjson::to_json(payload, options), expected);
+        ASSERT_EQ(pyjson::dumps(payload, options), expected.dump());
+        options.sort_keys = false;
+        pyjson::dump_options plain;
+        plain.sort_keys = false;
+        ASSERT_EQ(pyjson::dumps(payload, options), pyjson::dumps(payload, plain));
+#ifdef PYBIND11_JSON_HAS_ORDERED_JSON
+        ASSERT_EQ(pyjson::to_json<nl::ordered_json>(payload, options), pyjson::to_json<nl::ordered_json>(payload));
+#endif
+#ifdef PYBIND11_JSON_HAS_BINARY
+        ASSERT_EQ(pyjson::to_cbor(payload, options), pyjson::to_cbor(payload));
+#endif
+    }
+
+    // The shared dict is converted on its first two occurrences only
+    counted.attr("calls") = 0;
+    pyjson::options options;
+    options.memoize = pyjson::memo_policy::all;
+    pyjson::to_json(payload, options);
+    ASSERT_EQ(counted.attr("calls").cast<int>(), 2);
+
+    py::exec("loop = []; loop.append([loop, loop])");
+    ASSERT_THROW(pyjson::to_json(main.attr("loop"), options), std::runtime_error);
+    std::string error;
+    nl::json j;
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("[[object()], [object()]] * 2"), j, error, options));
+}
+
+TEST(pyjson_tojson, try_to_json)
+{
+    py::scoped_interpreter guard;
+    std::string error;
+    nl::json j = "untouched";
+
+    ASSERT_TRUE(pyjson::try_to_json(py::eval("{'a': [1, 2.5]}"), j, error));
+    ASSERT_EQ(j, R"({"a": [1, 2.5]})"_json);
+
+    j = "untouched";
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("object()"), j, error));
+    ASSERT_EQ(error.rfind("to_json not implemented for this type of object", 0), 0u);
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("{'a': [1, {'b': object()}]}"), j, error));
+    ASSERT_EQ(error.rfind("to_json not implemented for this type of object", 0), 0u);
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("[2**70]"), j, error));
+    ASSERT_EQ(error.rfind("to_json received an integer out of range", 0), 0u);
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("{1: 2}"), j, error, [] { pyjson::options o; o.non_str_keys = pyjson::key_policy::error; return o; }()));
+    ASSERT_EQ(error.rfind("to_json received a dict key which is not a string", 0), 0u);
+
+    py::exec("loop = []; loop.append([loop])");
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("loop"), j, error));
+    ASSERT_EQ(error, "Circular reference detected");
+    ASSERT_EQ(j, "untouched");
+
+    // Failing without exceptions never calls repr
+    py::exec("class Loud:\n    def __repr__(self):\n        raise RuntimeError('repr called')\n");
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("Loud()"), j, error));
+    ASSERT_EQ(error, "to_json not implemented for this type of object: Loud");
+    ASSERT_FALSE(pyjson::try_to_json(py::eval("[Loud()]"), j, error));
+    ASSERT_EQ(error, "to_json not implemented for this type of object: Loud");
+
+    // Bindings keep the reason of the failed conversion
+    static py::module_::module_def def;
+    py::module m = py::module_::create_extension_module("casters", nullptr, &def);
+    m.def("identity", +[](nl::json value) { return value; });
+    ASSERT_EQ(pyjson::to_json(m.attr("identity")(py::eval("[1, 'a']"))), R"([1, "a"])"_json);
+    ASSERT_THROW(m.attr("identity")(py::eval("[1, object()]")), py::error_already_set);
+    ASSERT_EQ(pyjson::last_load_error().rfind("to_json not implemented for this type of object", 0), 0u);
+    m.attr("identity")(py::eval("[2]"));
+    ASSERT_EQ(pyjson::last_load_error(), "");
+}
+
+#ifdef PYBIND11_JSON_STATS
+TEST(pyjson_stats, counters)
+{
+    py::scoped_interpreter guard;
+    std::vector<std::pair<std::string, pyjson::conversion_stats>> calls;
+    pyjson::set_stats_callback([&calls](const char* operation, const pyjson::conversion_stats& stats)
+    {
+        calls.emplace_back(operation, stats);
+    });
+    pyjson::thread_stats() = pyjson::conversion_stats();
+
+    pyjson::to_json(py::eval("{'a': [1, 2.5, None, True, 'xyz'], 'b': b'\\x00\\x01\\x02'}"));
+    ASSERT_EQ(calls.size(), 1u);
+    ASSERT_EQ(calls[0].first, "to_json");
+    const pyjson::conversion_stats& stats = calls[0].second;
+    ASSERT_EQ(stats.conversions, 1u);
+    ASSERT_EQ(stats.objects, 1u);
+    ASSERT_EQ(stats.arrays, 1u);
+    ASSERT_EQ(stats.keys, 2u);
+    ASSERT_EQ(stats.integers, 1u);
+    ASSERT_EQ(stats.floats, 1u);
+    ASSERT_EQ(stats.nulls, 1u);
+    ASSERT_EQ(stats.booleans, 1u);
+    ASSERT_EQ(stats.strings, 2u);
+    ASSERT_EQ(stats.string_bytes, 9u); // "a", "b", "xyz" and "AAEC"
+    ASSERT_EQ(stats.base64_bytes, 3u);
+    ASSERT_EQ(stats.max_depth, 2u);
+    ASSERT_EQ(stats.max_container_size, 5u);
+
+    // Text, trees and nested conversions
+    pyjson::loads(R"({"x": [[], [1, 2, 3]], "y": "z"})");
+    ASSERT_EQ(calls.back().first, "loads");
+    ASSERT_EQ(calls.back().second.max_depth, 3u);
+    ASSERT_EQ(calls.back().second.max_container_size, 3u);
+    ASSERT_EQ(calls.back().second.arrays, 3u);
+    pyjson::from_json(R"({"x": [[], [1, 2, 3]], "y": "z"})"_json);
+    ASSERT_EQ(calls.back().first, "from_json");
+    ASSERT_EQ(calls.back().second.integers, 3u);
+    ASSERT_EQ(calls.back().second.string_bytes, 3u);
+
+    static py::module_::module_def def;
+    py::module m = py::module_::create_extension_module("stats", nullptr, &def);
+    m.def("identity", +[](nl::json value) { return value; });
+    m.attr("identity")(py::eval("[1, 'a']"));
+    ASSERT_EQ(calls.size(), 5u);
+    ASSERT_EQ(calls[3].first, "type_caster");
+    ASSERT_EQ(calls[4].first, "type_caster");
+    ASSERT_EQ(calls[4].second.strings, 1u);
+
+    ASSERT_EQ(pyjson::thread_stats().conversions, 5u);
+    ASSERT_EQ(pyjson::thread_stats().max_depth, 3u);
+    py::dict exported = pyjson::stats_dict(pyjson::thread_stats());
+    ASSERT_EQ(exported["conversions"].cast<int>(), 5);
+    ASSERT_EQ(exported["floats"].cast<int>(), 1);
+
+    pyjson::set_stats_callback(nullptr);
+}
+#endif
+
+TEST(pyjson_tojson, converters)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+import datetime, enum
+
+class Point:
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+class Point3D(Point):
+    pass
+
+class Color(enum.IntEnum):
+    RED = 1
+
+class Name(str):
+    pass
+
+class Loop:
+    pass
+)");
+    py::object main = py::module::import("__main__");
+    py::object date = py::module::import("datetime").attr("date");
+    converters_guard converters;
+
+    pyjson::register_converter(date, [](const py::handle& obj) { return obj.attr("isoformat")(); });
+    pyjson::register_converter(main.attr("Point"), [](const py::handle& obj) { return py::object(py::make_tuple(obj.attr("x"), obj.attr("y"))); });
+    pyjson::register_converter(main.attr("Loop"), [](const py::handle& obj) { return py::reinterpret_borrow<py::object>(obj); });
+
+    py::object obj = py::eval("[datetime.date(2020, 1, 2), datetime.datetime(2020, 1, 2, 3), Point(1, 2), Point3D(3, 4), Color.RED, Name('n'), True]");
+    nl::json j = pyjson::to_json(obj);
+    ASSERT_EQ(j, R"(["2020-01-02", "2020-01-02T03:00:00", [1, 2], [3, 4], 1, "n", true])"_json);
+    ASSERT_EQ(pyjson::dumps(obj), j.dump());
+
+    ASSERT_THROW(pyjson::to_json(main.attr("Loop")()), std::runtime_error);
+    pyjson::options unchecked;
+    unchecked.cycles = pyjson::cycle_check::none;
+    ASSERT_THROW(pyjson::to_json(main.attr("Loop")(), unchecked), std::runtime_error);
+    ASSERT_THROW(pyjson::register_converter(py::int_(1), nullptr), std::runtime_error);
+
+    pyjson::unregister_converter(main.attr("Point"));
+    ASSERT_THROW(pyjson::to_json(main.attr("Point")(1, 2)), std::runtime_error);
+
+    pyjson::clear_converters();
+    ASSERT_THROW(pyjson::to_json(obj), std::runtime_error);
+}
+
+TEST(pyjson_converters, mutating_dict)
+{
+    py::scoped_interpreter guard;
+    py::exec(R"(
+class Clearer:
+    pass
+
+shared = {"a": Clearer(), "b": {"k": [1, 2]}, "c": "text"}
+)");
+    py::object main = py::module::import("__main__");
+    converters_guard converters;
+
+    // The converter empties the dict being walked: the remaining items were
+    // read before it ran and must still be alive
+    pyjson::register_converter(main.attr("Clearer"), [main](const py::handle&)
+    {
+        main.attr("shared").attr("clear")();
+        return py::object(py::str("cleared"));
+    });
+
+    py::object shared = main.attr("shared");
+    nl::json j = pyjson::to_json(shared);
+    ASSERT_EQ(j, R"({"a": "cleared", "b": {"k": [1, 2]}, "c": "text"})"_json);
+
+    main.attr("shared") = py::eval("{'a': Clearer(), 'b': {'k': [1, 2]}, 'c': 'text'}");
+    ASSERT_EQ(pyjson::dumps(main.attr("shared")), j.dump());
+}
+
+TEST(pyjson_view, lazy_access)
+{
+    py::scoped_interpreter guard;
+    nl::json j = R"({"name": "config", "ids": [1, -2, 3.5, null], "nested": {"flag": true, "deep": {"n": 18446744073709551615}}})"_json;
+    py::object main = py::module::import("__main__");
+    main.attr("view") = pyjson::make_view(pyjson::json_view(j));
+
+    py::exec(R"(
+import collections.abc
+nested = view["nested"]
+checks = [
+    isinstance(view, collections.abc.Mapping),
+    isinstance(view["ids"], collections.abc.Sequence),
+    len(view) == 3 and sorted(view) == ["ids", "name", "nested"],
+    view["name"] == "config" and view.get("missing", 7) == 7 and view.get("missing") is None,
+    "ids" in view and "missing" not in view and 1 not in view,
+    nested is view["nested"] and nested["deep"]["n"] == 2**64 - 1,
+    list(view["ids"]) == [1, -2, 3.5, None] and view["ids"][-1] is None and view["ids"][1::2] == [-2, None],
+    3.5 in view["ids"] and 4 not in view["ids"],
+    view == view.to_python() and nested == {"flag": True, "deep": {"n": 2**64 - 1}} and nested != {},
+    dict(view.items())["ids"] == view["ids"] and len(view.values()) == 3,
+]
+errors = []
+for expr, error in [(lambda: view["missing"], KeyError), (lambda: view["ids"][4], IndexError),
+                    (lambda: view["ids"]["a"], TypeError), (lambda: type(view)(), TypeError),
+                    (lambda: hash(view), TypeError)]:
+    try:
+        expr()
+    except error:
+        errors.append(True)
+)");
+    py::list checks = main.attr("checks");
+    for (std::size_t i = 0; i < checks.size(); ++i)
+    {
+        ASSERT_TRUE(checks[i].cast<bool>()) << "check " << i;
+    }
+    ASSERT_EQ(py::list(main.attr("errors")).size(), 5u);
+
+    // PySequence_GetItem adds the length to negative indices only once
+    py::object ids = py::eval("view['ids']");
+    ASSERT_TRUE(py::reinterpret_steal<py::object>(PySequence_GetItem(ids.ptr(), -1)).is_none());
+    ASSERT_EQ(PySequence_GetItem(ids.ptr(), -5), nullptr);
+    ASSERT_TRUE(PyErr_ExceptionMatches(PyExc_IndexError));
+    PyErr_Clear();
+
+    // Views convert back without going through Python objects
+    ASSERT_EQ(pyjson::to_json(main.attr("view")), j);
+    ASSERT_EQ(pyjson::to_json(py::eval("[view['nested'], view['ids']]")), nl::json::array({j["nested"], j["ids"]}));
+    ASSERT_EQ(pyjson::dumps(main.attr("view")), j.dump());
+
+    pyjson::json_view scalar(nl::json(42));
+    ASSERT_EQ(pyjson::make_view(scalar).cast<int>(), 42);
+
+    // Views passed back to a binding share their document
+    static py::module_::module_def def;
+    py::module m = py::module_::create_extension_module("views", nullptr, &def);
+    m.def("root", +[](pyjson::json_view v) { return nl::json(&v.json() == v.root().get()); });
+    m.def("identity", +[](pyjson::json_view v) { return v; });
+    ASSERT_FALSE(m.attr("root")(py::eval("view['nested']")).cast<bool>());
+    ASSERT_TRUE(m.attr("root")(py::dict()).cast<bool>());
+    ASSERT_TRUE(m.attr("identity")(py::eval("view['nested']")).equal(py::eval("view['nested']")));
+}
+
+TEST(pyjson_ndjson, round_trip)
+{
+    py::scoped_interpreter guard;
+    py::object items = py::eval(R"([{"id": i, "name": "n%d" % i, "tags": ["a", "b\nc"]} for i in range(1000)] + [1, "x", None, []])");
+
+    std::string text;
+    pyjson::dump_lines(items, text);
+    ASSERT_EQ(std::count(text.begin(), text.end(), '\n'), 1004);
+    ASSERT_EQ(text.substr(0, text.find('\n')), R"({"id":0,"name":"n0","tags":["a","b\nc"]})");
+
+    // A record which fails leaves no partial line behind
+    std::string partial = "0\n";
+    ASSERT_THROW(pyjson::dump_lines(py::eval("[1, [2, object()], 3]"), partial), std::runtime_error);
+    ASSERT_EQ(partial, "0\n1\n");
+
+    // Blank lines, CRLF and a last line without newline
+    std::string input = "\n" + text + "  \r\n{\"last\": true}\r";
+    pyjson::ndjson_reader memory(input.data(), input.size());
+    py::list all;
+    for (py::list batch = memory.next_batch(300); batch.size() > 0; batch = memory.next_batch(300))
+    {
+        ASSERT_LE(batch.size(), 300u);
+        for (const py::handle item : batch)
+        {
+            all.append(item);
+        }
+    }
+    ASSERT_TRUE(memory.done());
+    ASSERT_EQ(all.size(), 1005u);
+    nl::json expected = pyjson::to_json(items);
+    ASSERT_EQ(pyjson::to_json(py::eval("lambda l: l[:-1]")(all)), expected);
+    ASSERT_EQ(pyjson::to_json(all[1004]), R"({"last": true})"_json);
+
+    // File descriptors, with chunks smaller than the lines
+    std::FILE* file = std::tmpfile();
+    ASSERT_NE(file, nullptr);
+    {
+        std::unique_ptr<pyjson::ndjson_writer> writer(new pyjson::ndjson_writer(fileno(file), pyjson::dump_options(), 100));
+        writer->write_all(items);
+        ASSERT_THROW(writer->write(py::eval("object()")), std::runtime_error);
+        // The destructor flushes the last lines without the GIL
+        py::gil_scoped_release release;
+        writer.reset();
+    }
+    std::rewind(file);
+    pyjson::ndjson_reader reader(fileno(file), 16);
+    py::list first = reader.next_batch(1000);
+    py::list second = reader.next_batch(1000);
+    ASSERT_EQ(first.size(), 1000u);
+    ASSERT_EQ(second.size(), 4u);
+    ASSERT_EQ(reader.next_batch().size(), 0u);
+    ASSERT_TRUE(reader.done());
+    ASSERT_EQ(pyjson::to_json(first), nl::json(expected.begin(), expected.begin() + 1000));
+    std::fclose(file);
+
+    std::string broken = "1\n{\"a\": }\n3\n";
+    pyjson::ndjson_reader errors(broken.data(), broken.size());
+    ASSERT_THROW(errors.next_batch(), nl::json::parse_error);
+    ASSERT_EQ(errors.line(), 2u);
+    ASSERT_EQ(errors.next_batch().size(), 1u);
+}
+
+TEST(pyjson_loads, pointers)
+{
+    py::scoped_interpreter guard;
+    std::string text = R"({"meta": {"id": 7, "tags": ["x"]}, "data": {"items": [{"a": 1}, {"a/b": [2, 3]}], "skip": {"deep": [1, 2, {"x": null}]}}, "~key": true})";
+    nl::json j = nl::json::parse(text);
+
+    ASSERT_EQ(pyjson::to_json(pyjson::from_json(j, nl::json::json_pointer("/data/items/1"))), j["data"]["items"][1]);
+    ASSERT_THROW(pyjson::from_json(j, nl::json::json_pointer("/data/missing")), nl::json::out_of_range);
+
+    py::dict selected = pyjson::loads(text, {"/data/items", "/meta/id", "/data/items/1/a~1b/0", "/~0key", "/data/missing", "/meta/tags/1"});
+    ASSERT_EQ(selected.size(), 4u);
+    ASSERT_EQ(pyjson::to_json(selected["/data/items"]), j["data"]["items"]);
+    ASSERT_EQ(selected["/meta/id"].cast<int>(), 7);
+    ASSERT_EQ(selected["/data/items/1/a~1b/0"].cast<int>(), 2);
+    ASSERT_TRUE(selected["/~0key"].cast<bool>());
+
+    ASSERT_EQ(pyjson::to_json(pyjson::loads(text, {""})[py::str("")]), j);
+    ASSERT_EQ(pyjson::loads(text, std::vector<std::string>()).size(), 0u);
+
+    // Parsing stops after the last selected value
+    py::dict first = pyjson::loads(R"({"a": [1, {"b": 2}], "rest": [)", {"/a/1/b"});
+    ASSERT_EQ(first[py::str("/a/1/b")].cast<int>(), 2);
+
+    ASSERT_THROW(pyjson::loads(R"({"a": [1, 2)", {"/b"}), nl::json::parse_error);
+    ASSERT_THROW(pyjson::loads(text, {"no/slash"}), nl::json::parse_error);
+
+    // Tokens resolved within a selected value follow the same rules
+    std::string nul_key("/k/a\0b", 6);
+    py::dict nested = pyjson::loads(R"({"k": {"a": 1, "a\u0000b": 2, "l": [3, 4]}})", {"/k", nul_key, "/k/l/1", "/k/l/01"});
+    ASSERT_EQ(nested.size(), 3u);
+    ASSERT_EQ(nested[py::str(nul_key)].cast<int>(), 2);
+    ASSERT_EQ(nested[py::str("/k/l/1")].cast<int>(), 4);
+    ASSERT_EQ(pyjson::loads(R"({"l": [3, 4]})", {"/l/01"}).size(), 0u);
+}
+
+TEST(pyjson_loads, load_file)
+{
+    py::scoped_interpreter guard;
+    std::string text = R"({"records": [{"id": 1, "name": "a"}, {"id": 2, "name": "\u00e9"}], "total": 2.5})";
+    std::string path = ::testing::TempDir() + "pybind11_json_load_file.json";
+    std::string empty = ::testing::TempDir() + "pybind11_json_load_file_empty.json";
+    std::ofstream(path, std::ios::binary) << text;
+    std::ofstream(empty, std::ios::binary).flush();
+
+    py::object obj = pyjson::load_file(path);
+    ASSERT_EQ(pyjson::to_json(obj), nl::json::parse(text));
+
+    pyjson::key_cache keys;
+    py::object cached = pyjson::load_file(path, keys);
+    ASSERT_EQ(pyjson::to_json(cached), nl::json::parse(text));
+    ASSERT_EQ(keys.size(), 4u);
+
+    ASSERT_THROW(pyjson::load_file(empty), nl::json::parse_error);
+    ASSERT_THROW(pyjson::load_file(path + ".missing"), std::system_error);
+
+    std::remove(path.c_str());
+    std::remove(empty.c_str());
+}
+
+TEST(nljson_serializers_fromjson, numpy_arrays)
+{
+    py::scoped_interpreter guard;
+    py::object numpy;
+    try
+    {
+        numpy = py::module::import("numpy");
+    }
+    catch (const py::error_already_set&)
+    {
+        GTEST_SKIP() << "numpy is not available";
+    }
+
+    nl::json j = R"({"floats": [1, 2.5], "matrix": [[1, 2], [3, 4]], "big": [18446744073709551615, 1],
+                     "ragged": [[1], [2, 3]], "deep_ragged": [[[1, 2], [3, 4]], [{"a": [5]}]],
+                     "mixed": [1, "a"], "records": [{"a": [1, 2]}], "empty": []})"_json;
+    pyjson::from_json_options options;
+    options.numpy_arrays = true;
+    py::dict obj = pyjson::from_json(j, options);
+
+    py::object ndarray = numpy.attr("ndarray");
+    ASSERT_TRUE(py::isinstance(obj["floats"], ndarray));
+    ASSERT_EQ(py::str(obj["floats"].attr("dtype")).cast<std::string>(), "float64");
+    ASSERT_EQ(py::str(obj["matrix"].attr("dtype")).cast<std::string>(), "int64");
+    ASSERT_EQ(py::repr(obj["matrix"].attr("shape")).cast<std::string>(), "(2, 2)");
+    ASSERT_EQ(py::str(obj["big"].attr("dtype")).cast<std::string>(), "uint64");
+    // A ragged array is made of lists only, down to its leaves
+    ASSERT_TRUE(py::isinstance<py::list>(obj["ragged"]));
+    ASSERT_TRUE(py::isinstance<py::list>(py::list(obj["ragged"])[0]));
+    py::list deep_ragged = obj["deep_ragged"];
+    ASSERT_TRUE(py::isinstance<py::list>(deep_ragged[0]));
+    ASSERT_TRUE(py::isinstance<py::list>(py::list(deep_ragged[0])[0]));
+    ASSERT_TRUE(py::isinstance<py::list>(py::dict(py::list(deep_ragged[1])[0])["a"]));
+    ASSERT_TRUE(py::isinstance<py::list>(obj["mixed"]));
+    ASSERT_TRUE(py::isinstance(py::dict(py::list(obj["records"])[0])["a"], ndarray));
+    ASSERT_TRUE(py::isinstance<py::list>(obj["empty"]));
+
+    ASSERT_EQ(pyjson::to_json(obj), j);
+}